@@ -0,0 +1,221 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkaggregator.h"
+
+#include <math.h>
+
+void QkAggregator::Rollup::reset(quint64 start)
+{
+    timestamp = start;
+    count = 0;
+    min = 0.0;
+    max = 0.0;
+    sum = 0.0;
+    sumSquares = 0.0;
+}
+
+void QkAggregator::Rollup::add(float value)
+{
+    if(count == 0 || value < min)
+        min = value;
+    if(count == 0 || value > max)
+        max = value;
+    sum += value;
+    sumSquares += (double) value * value;
+    count++;
+}
+
+void QkAggregator::Rollup::merge(const Rollup &other)
+{
+    if(other.count == 0)
+        return;
+    if(count == 0 || other.min < min)
+        min = other.min;
+    if(count == 0 || other.max > max)
+        max = other.max;
+    if(count == 0 || other.timestamp < timestamp)
+        timestamp = other.timestamp;
+    sum += other.sum;
+    sumSquares += other.sumSquares;
+    count += other.count;
+}
+
+float QkAggregator::Rollup::mean() const
+{
+    return (count > 0 ? (float) (sum / count) : 0.0);
+}
+
+float QkAggregator::Rollup::rms() const
+{
+    return (count > 0 ? (float) sqrt(sumSquares / count) : 0.0);
+}
+
+QkAggregator::QkAggregator()
+{
+    m_channels = 0;
+    m_last = 0;
+    clear();
+}
+
+int QkAggregator::resolution(int level)
+{
+    switch(level)
+    {
+    case Level100ms: return 100;
+    case Level1s: return 1000;
+    case Level1min: return 60*1000;
+    default: return 60*60*1000;
+    }
+}
+
+void QkAggregator::setChannels(int channels)
+{
+    if(channels == m_channels)
+        return;
+    m_channels = channels;
+    for(int l = 0; l < Levels; l++)
+    {
+        m_levels[l].buckets = QVector<Rollup>(channels * Capacity);
+        m_levels[l].current = QVector<Rollup>(channels);
+    }
+    clear();
+}
+
+void QkAggregator::clear()
+{
+    for(int l = 0; l < Levels; l++)
+    {
+        Ring &ring = m_levels[l];
+        for(int c = 0; c < ring.current.count(); c++)
+            ring.current[c].reset(0);
+        ring.start = 0;
+        ring.head = 0;
+        ring.count = 0;
+    }
+    m_last = 0;
+}
+
+void QkAggregator::add(const float *values, int count, quint64 timestamp)
+{
+    setChannels(count);
+
+    for(int l = 0; l < Levels; l++)
+    {
+        Ring &ring = m_levels[l];
+        const quint64 start = timestamp - timestamp % resolution(l);
+        // a resync may move time back (see QkProtocolWorker): such samples
+        // are folded into the open bucket rather than reopening a closed one
+        if(start > ring.start)
+        {
+            close(ring);
+            for(int c = 0; c < count; c++)
+                ring.current[c].reset(start);
+            ring.start = start;
+        }
+
+        Rollup *current = ring.current.data();
+        for(int c = 0; c < count; c++)
+            current[c].add(values[c]);
+    }
+    m_last = qMax(m_last, timestamp);
+}
+
+// Moves the open buckets of ring (if any) into its history.
+void QkAggregator::close(Ring &ring)
+{
+    if(m_channels == 0 || ring.current.at(0).count == 0)
+        return;
+
+    Rollup *buckets = ring.buckets.data();
+    for(int c = 0; c < m_channels; c++)
+        buckets[c*Capacity + ring.head] = ring.current.at(c);
+
+    if(++ring.head == Capacity)
+        ring.head = 0;
+    if(ring.count < Capacity)
+        ring.count++;
+}
+
+// index 0 is the oldest closed bucket
+const QkAggregator::Rollup& QkAggregator::bucket(const Ring &ring, int channel, int index)
+{
+    int pos = ring.head - ring.count + index;
+    if(pos < 0)
+        pos += Capacity;
+    return ring.buckets.at(channel*Capacity + pos);
+}
+
+// Summary of channel over the last ms milliseconds (up to the newest
+// sample), accurate to the resolution of the level used to answer it.
+QkAggregator::Rollup QkAggregator::window(int channel, int ms)
+{
+    Rollup result;
+    if(channel < 0 || channel >= m_channels)
+        return result;
+
+    int level = 0;
+    while(level < Levels - 1 &&
+          (ms / resolution(level) > MaxWindowBuckets ||
+           (qint64) resolution(level) * Capacity < ms))
+        level++;
+
+    const Ring &ring = m_levels[level];
+    const quint64 from = (m_last > (quint64) ms ? m_last - ms : 0);
+
+    result.merge(ring.current.at(channel));
+    for(int i = ring.count - 1; i >= 0; i--)
+    {
+        const Rollup &b = bucket(ring, channel, i);
+        if(b.timestamp + resolution(level) <= from)
+            break;
+        result.merge(b);
+    }
+    return result;
+}
+
+// Appends the buckets of channel at level that start in [from, to] to out,
+// oldest first, including the still open one.
+int QkAggregator::rollups(int channel, int level, quint64 from, quint64 to, QVector<Rollup> *out)
+{
+    if(channel < 0 || channel >= m_channels || level < 0 || level >= Levels)
+        return 0;
+
+    const Ring &ring = m_levels[level];
+    int total = 0;
+    for(int i = 0; i < ring.count; i++)
+    {
+        const Rollup &b = bucket(ring, channel, i);
+        if(b.timestamp > to)
+            break;
+        if(b.timestamp >= from)
+        {
+            out->append(b);
+            total++;
+        }
+    }
+
+    const Rollup &current = ring.current.at(channel);
+    if(current.count > 0 && current.timestamp >= from && current.timestamp <= to)
+    {
+        out->append(current);
+        total++;
+    }
+    return total;
+}
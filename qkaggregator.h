@@ -0,0 +1,101 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKAGGREGATOR_H
+#define QKAGGREGATOR_H
+
+#include "qkcore_lib.h"
+
+#include <QtGlobal>
+#include <QVector>
+
+/**
+ * Incremental min/max/mean/RMS rollups of every channel at several fixed
+ * resolutions. Each sample updates the open bucket of every level (O(1)
+ * per channel); closed buckets go to a per-level ring, so queries never
+ * touch raw samples.
+ */
+class QKLIBSHARED_EXPORT QkAggregator
+{
+public:
+    enum Level
+    {
+        Level100ms,
+        Level1s,
+        Level1min,
+        Level1h,
+        Levels
+    };
+    enum
+    {
+        Capacity = 720, // buckets kept per level and channel
+        MaxWindowBuckets = 120
+    };
+
+    class Rollup
+    {
+    public:
+        Rollup() { reset(0); }
+        void reset(quint64 start);
+        void add(float value);
+        void merge(const Rollup &other);
+        float mean() const;
+        float rms() const;
+
+        quint64 timestamp; // start of the bucket
+        int count;
+        float min;
+        float max;
+        double sum;
+        double sumSquares;
+    };
+
+    QkAggregator();
+
+    static int resolution(int level);
+
+    void setChannels(int channels);
+    int channels() { return m_channels; }
+    void clear();
+
+    void add(const float *values, int count, quint64 timestamp);
+
+    Rollup window(int channel, int ms);
+    int rollups(int channel, int level, quint64 from, quint64 to, QVector<Rollup> *out);
+
+private:
+    class Ring
+    {
+    public:
+        QVector<Rollup> buckets; // channel c uses buckets[c*Capacity, (c+1)*Capacity)
+        QVector<Rollup> current;
+        quint64 start;
+        int head;
+        int count;
+    };
+
+    void close(Ring &ring);
+    const Rollup& bucket(const Ring &ring, int channel, int index);
+
+    Ring m_levels[Levels];
+    int m_channels;
+    quint64 m_last;
+};
+
+#endif // QKAGGREGATOR_H
@@ -0,0 +1,537 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkarchive.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QThread>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QMutexLocker>
+
+#include <string.h>
+#if defined(Q_OS_UNIX)
+#include <sys/mman.h>
+#endif
+
+static const quint32 ArchiveMagic = 0x52414B51; // "QKAR"
+
+QkArchiveWorker::QkArchiveWorker(QkArchive *archive)
+{
+    m_archive = archive;
+    m_quit = false;
+}
+
+void QkArchiveWorker::run()
+{
+    m_mutex.lock();
+    while(!m_quit)
+    {
+        if(!m_wake.fetchAndStoreAcquire(0))
+            m_condition.wait(&m_mutex, QkArchive::FlushInterval);
+        if(m_quit)
+            break;
+        m_mutex.unlock();
+
+        m_archive->flush();
+        m_archive->prepare();
+
+        m_mutex.lock();
+    }
+    m_mutex.unlock();
+
+    emit finished();
+}
+
+void QkArchiveWorker::quit()
+{
+    QMutexLocker locker(&m_mutex);
+    m_quit = true;
+    m_condition.wakeOne();
+}
+
+// Called by the writer, which must not block on m_mutex. A wake-up racing
+// with the worker going to sleep is picked up by the flag or, at worst,
+// after FlushInterval.
+void QkArchiveWorker::wakeUp()
+{
+    m_wake.storeRelease(1);
+    m_condition.wakeOne();
+}
+
+QkArchive::QkArchive(const QString &path, QObject *parent) :
+    QObject(parent)
+{
+    m_path = path;
+    m_segmentRows.store(DefaultSegmentRows);
+    QDir().mkpath(m_path);
+
+    m_workerThread = new QThread(this);
+    m_worker = new QkArchiveWorker(this);
+    m_worker->moveToThread(m_workerThread);
+
+    connect(m_workerThread, SIGNAL(started()), m_worker, SLOT(run()), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(finished()), m_workerThread, SLOT(quit()), Qt::DirectConnection);
+
+    m_workerThread->start();
+}
+
+// Whoever calls append() must have stopped doing so (see QkCore::setArchive).
+QkArchive::~QkArchive()
+{
+    m_worker->quit();
+    m_workerThread->wait();
+    delete m_worker;
+
+    flush();
+    foreach(Stream *stream, m_writerStreams)
+    {
+        // empty segments are spares nobody wrote to
+        foreach(Segment *segment, stream->segments)
+            closeSegment(segment, segment->count.load() == 0);
+        delete stream;
+    }
+}
+
+// Applies to segments created from now on.
+void QkArchive::setSegmentRows(int rows)
+{
+    if(rows > 0)
+        m_segmentRows.store(rows);
+}
+
+// Registers a source (a connection) under a stable name and returns the
+// id to pass to append() and query(). The same name gives the same id.
+int QkArchive::addSource(const QString &name)
+{
+    QString dirName = name;
+    for(int i = 0; i < dirName.count(); i++)
+    {
+        const QChar c = dirName.at(i);
+        if(!c.isLetterOrNumber() && c != '-' && c != '_' && c != '.')
+            dirName[i] = '_';
+    }
+
+    QMutexLocker locker(&m_sourcesMutex);
+    int source = m_sources.indexOf(dirName);
+    if(source < 0)
+    {
+        source = m_sources.count();
+        m_sources.append(dirName);
+    }
+    return source;
+}
+
+QStringList QkArchive::sources()
+{
+    QMutexLocker locker(&m_sourcesMutex);
+    return m_sources;
+}
+
+QString QkArchive::streamDir(const Key &key)
+{
+    m_sourcesMutex.lock();
+    const QString source = m_sources.value(key.first, QString::number(key.first));
+    m_sourcesMutex.unlock();
+    return QString("%1/%2/%3").arg(m_path).arg(source).arg(key.second, 4, 16, QChar('0'));
+}
+
+// Called from a single thread (the protocol worker, through QkCore). Only
+// the first sample of a stream, a change of channel count or a worker a
+// whole segment behind make it touch the file system.
+void QkArchive::append(int source, int address, const float *values, int count, quint64 timestamp)
+{
+    if(count <= 0)
+        return;
+
+    const Key key(source, address);
+    Stream *s = m_writerStreams.value(key, 0);
+    if(s == 0)
+        s = openStream(key, count);
+
+    Segment *segment = s->active;
+    if(segment == 0 || segment->channels != count || segment->count.load() >= segment->rows)
+    {
+        segment = rotate(s, count);
+        if(segment == 0)
+        {
+            m_droppedSamples.ref();
+            return;
+        }
+    }
+
+    const int row = segment->count.load();
+    segment->timestamps[row] = timestamp;
+    for(int c = 0; c < count; c++)
+        segment->columns.at(c)[row] = values[c];
+    if(row % IndexStride == 0)
+        segment->index[row / IndexStride] = timestamp;
+    segment->header->count = row + 1;
+    segment->count.storeRelease(row + 1);
+}
+
+// Appends the samples of channel taken in [from, to] to timestamps and
+// values (either may be 0) and returns how many were found. A stream not
+// open in this run is read from disk if it exists: its segments are mapped
+// on the caller's thread for the duration of the call. Nothing is created.
+int QkArchive::query(int source, int address, int channel, quint64 from, quint64 to,
+                     QVector<quint64> *timestamps, QVector<float> *values)
+{
+    const Key key(source, address);
+    {
+        QReadLocker locker(&m_lock);
+        Stream *s = m_streams.value(key, 0);
+        if(s != 0)
+            return query(s, channel, from, to, timestamps, values);
+    }
+
+    Stream stream;
+    stream.key = key;
+    stream.dir = streamDir(key);
+    if(!QDir(stream.dir).exists())
+        return 0;
+    loadSegments(&stream);
+    const int total = query(&stream, channel, from, to, timestamps, values);
+    foreach(Segment *segment, stream.segments)
+        closeSegment(segment);
+    return total;
+}
+
+int QkArchive::query(Stream *stream, int channel, quint64 from, quint64 to,
+                     QVector<quint64> *timestamps, QVector<float> *values)
+{
+    int first, last, count, offset, total = 0;
+
+    foreach(Segment *segment, stream->segments)
+    {
+        const int n = segment->count.loadAcquire();
+        if(n == 0 || channel < 0 || channel >= segment->channels)
+            continue;
+        if(segment->timestamps[0] > to || segment->timestamps[n-1] < from)
+            continue;
+
+        first = lowerBound(segment, n, from);
+        last = (to < ~Q_UINT64_C(0) ? lowerBound(segment, n, to + 1) : n);
+        count = last - first;
+        if(count <= 0)
+            continue;
+
+        if(timestamps != 0)
+        {
+            offset = timestamps->count();
+            timestamps->resize(offset + count);
+            memcpy(timestamps->data() + offset, segment->timestamps + first, count * sizeof(quint64));
+        }
+        if(values != 0)
+        {
+            offset = values->count();
+            values->resize(offset + count);
+            memcpy(values->data() + offset, segment->columns.at(channel) + first, count * sizeof(float));
+        }
+        total += count;
+    }
+    return total;
+}
+
+// Writer: loads what the stream already has on disk, publishes it to
+// query() and creates its first segment and a spare right away.
+QkArchive::Stream* QkArchive::openStream(const Key &key, int channels)
+{
+    Stream *stream = new Stream();
+    stream->key = key;
+    stream->dir = streamDir(key);
+    stream->active = 0;
+    stream->channels.store(channels);
+    loadSegments(stream);
+    m_writerStreams.insert(key, stream);
+
+    m_lock.lockForWrite();
+    m_streams.insert(key, stream);
+    m_lock.unlock();
+
+    stream->active = createSegment(stream, channels);
+    Segment *spare = createSegment(stream, channels);
+    if(spare != 0)
+        stream->spare.storeRelease(spare);
+    return stream;
+}
+
+// Creates the next segment of stream and lists it for query() and flush().
+// Called by the worker, or by the writer when it cannot wait for it.
+QkArchive::Segment* QkArchive::createSegment(Stream *stream, int channels)
+{
+    QDir().mkpath(stream->dir);
+    Segment *segment = openSegment(stream->dir, stream->next.fetchAndAddOrdered(1), channels, true);
+    if(segment == 0)
+        return 0;
+
+    m_lock.lockForWrite();
+    stream->segments.append(segment);
+    m_lock.unlock();
+    return segment;
+}
+
+// Writer: switches to the spare the worker prepared, or creates the
+// segment itself if the spare is late or of another width.
+QkArchive::Segment* QkArchive::rotate(Stream *stream, int channels)
+{
+    stream->channels.store(channels);
+    Segment *segment = stream->spare.fetchAndStoreAcquire(0);
+    if(segment != 0 && segment->channels != channels)
+    {
+        // give it back; the worker replaces it with one of the new width
+        stream->spare.testAndSetRelease(0, segment);
+        segment = 0;
+    }
+    if(segment == 0)
+        segment = createSegment(stream, channels);
+    m_worker->wakeUp();
+    if(segment == 0)
+        return 0;
+
+    stream->active = segment;
+    return segment;
+}
+
+// Opens the segments already on disk; new ones are numbered after them.
+void QkArchive::loadSegments(Stream *stream)
+{
+    int next = 0;
+    QStringList names = QDir(stream->dir).entryList(QStringList() << "*.ts", QDir::Files, QDir::Name);
+    foreach(const QString &name, names)
+    {
+        bool ok;
+        int number = name.left(name.indexOf('.')).toInt(&ok);
+        if(!ok)
+            continue;
+        next = qMax(next, number + 1);
+        Segment *segment = openSegment(stream->dir, number, 0, false);
+        if(segment != 0)
+            stream->segments.append(segment);
+    }
+    stream->next.store(next);
+}
+
+QkArchive::Segment* QkArchive::openSegment(const QString &dir, int number, int channels, bool create)
+{
+    const QString base = QString("%1/%2").arg(dir).arg(number, 6, 10, QChar('0'));
+    const QIODevice::OpenMode mode = (create ? QIODevice::ReadWrite | QIODevice::Truncate : QIODevice::ReadWrite);
+    int c, rows;
+
+    Segment *segment = new Segment();
+    segment->number = number;
+    segment->channels = 0;
+    segment->rows = 0;
+    segment->header = 0;
+    segment->timestamps = 0;
+    segment->flushed = 0;
+
+    segment->timeFile = new QFile(base + ".ts");
+    if(!segment->timeFile->open(mode))
+    {
+        qWarning() << __FUNCTION__ << "unable to open" << segment->timeFile->fileName();
+        closeSegment(segment);
+        return 0;
+    }
+    if(create)
+    {
+        rows = m_segmentRows.load();
+        segment->timeFile->resize(sizeof(Header) + rows * sizeof(quint64));
+    }
+    else if(segment->timeFile->size() < (qint64) sizeof(Header))
+    {
+        closeSegment(segment);
+        return 0;
+    }
+
+    uchar *map = segment->timeFile->map(0, segment->timeFile->size());
+    if(map == 0)
+    {
+        qWarning() << __FUNCTION__ << "unable to map" << segment->timeFile->fileName();
+        closeSegment(segment);
+        return 0;
+    }
+    segment->header = (Header*) map;
+    segment->timestamps = (quint64*) (map + sizeof(Header));
+
+    if(create)
+    {
+        segment->header->magic = ArchiveMagic;
+        segment->header->channels = channels;
+        segment->header->rows = rows;
+        segment->header->count = 0;
+    }
+    else
+    {
+        channels = segment->header->channels;
+        rows = segment->header->rows;
+        if(segment->header->magic != ArchiveMagic || rows <= 0 ||
+           segment->timeFile->size() < (qint64) (sizeof(Header) + rows * sizeof(quint64)))
+        {
+            qWarning() << __FUNCTION__ << "invalid segment" << segment->timeFile->fileName();
+            closeSegment(segment);
+            return 0;
+        }
+    }
+    segment->channels = channels;
+    segment->rows = rows;
+
+    for(c = 0; c < channels; c++)
+    {
+        QFile *file = new QFile(base + QString(".c%1").arg(c));
+        segment->columnFiles.append(file);
+        if(!file->open(mode))
+        {
+            qWarning() << __FUNCTION__ << "unable to open" << file->fileName();
+            closeSegment(segment);
+            return 0;
+        }
+        if(create)
+            file->resize(rows * sizeof(float));
+        map = (file->size() >= (qint64) (rows * sizeof(float)) ? file->map(0, file->size()) : 0);
+        if(map == 0)
+        {
+            qWarning() << __FUNCTION__ << "unable to map" << file->fileName();
+            closeSegment(segment);
+            return 0;
+        }
+        segment->columns.append((float*) map);
+    }
+
+    const int count = qMin((int) segment->header->count, rows);
+    segment->index.resize((rows + IndexStride - 1) / IndexStride);
+    for(int row = 0; row < count; row += IndexStride)
+        segment->index[row / IndexStride] = segment->timestamps[row];
+    segment->count.store(count);
+    segment->flushed = count;
+
+    return segment;
+}
+
+void QkArchive::closeSegment(Segment *segment, bool remove)
+{
+    if(segment->header != 0)
+        segment->timeFile->unmap((uchar*) segment->header);
+    for(int c = 0; c < segment->columns.count(); c++)
+        segment->columnFiles.at(c)->unmap((uchar*) segment->columns.at(c));
+
+    QList<QFile*> files = segment->columnFiles;
+    files.prepend(segment->timeFile);
+    foreach(QFile *file, files)
+    {
+        file->close();
+        if(remove)
+            file->remove();
+        delete file;
+    }
+    delete segment;
+}
+
+// First row of segment (among its count rows) taken at or after timestamp.
+int QkArchive::lowerBound(Segment *segment, int count, quint64 timestamp)
+{
+    int lo = 0, hi = (count + IndexStride - 1) / IndexStride, mid;
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(segment->index.at(mid) < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int first = (lo > 0 ? (lo - 1) * IndexStride : 0);
+    int last = qMin(lo * IndexStride, count);
+    while(first < last)
+    {
+        mid = (first + last) / 2;
+        if(segment->timestamps[mid] < timestamp)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    return first;
+}
+
+// Schedules write-back of the pages appended since the last flush.
+void QkArchive::flush()
+{
+    QList<Segment*> segments;
+
+    m_lock.lockForRead();
+    foreach(Stream *stream, m_streams)
+        segments.append(stream->segments);
+    m_lock.unlock();
+
+    foreach(Segment *segment, segments)
+    {
+        const int count = segment->count.loadAcquire();
+        if(count == segment->flushed)
+            continue;
+#if defined(Q_OS_UNIX)
+        msync(segment->header, sizeof(Header) + segment->rows * sizeof(quint64), MS_ASYNC);
+        foreach(float *column, segment->columns)
+            msync(column, segment->rows * sizeof(float), MS_ASYNC);
+#endif
+        segment->flushed = count;
+    }
+}
+
+// Keeps a spare segment of the wanted width ready for every stream, so
+// append() only has to switch mappings when a segment fills up.
+void QkArchive::prepare()
+{
+    QList<Stream*> streams;
+
+    m_lock.lockForRead();
+    streams = m_streams.values();
+    m_lock.unlock();
+
+    foreach(Stream *stream, streams)
+    {
+        const int channels = stream->channels.load();
+        Segment *spare = stream->spare.loadAcquire();
+        if(channels <= 0 || (spare != 0 && spare->channels == channels))
+            continue;
+        if(spare != 0)
+        {
+            // the writer may have taken it meanwhile, then it is its own
+            if(!stream->spare.testAndSetAcquire(spare, 0))
+                continue;
+            m_lock.lockForWrite();
+            stream->segments.removeOne(spare);
+            m_lock.unlock();
+            closeSegment(spare, true);
+        }
+
+        Segment *segment = createSegment(stream, channels);
+        if(segment == 0)
+            continue;
+        if(!stream->spare.testAndSetRelease(0, segment))
+        {
+            // the writer gave an old one back meanwhile, keep that
+            m_lock.lockForWrite();
+            stream->segments.removeOne(segment);
+            m_lock.unlock();
+            closeSegment(segment, true);
+        }
+    }
+}
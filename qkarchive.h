@@ -0,0 +1,180 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKARCHIVE_H
+#define QKARCHIVE_H
+
+#include "qkcore_lib.h"
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QPair>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QWaitCondition>
+
+class QFile;
+class QThread;
+class QkArchive;
+
+class QkArchiveWorker : public QObject
+{
+    Q_OBJECT
+public:
+    QkArchiveWorker(QkArchive *archive);
+
+    void wakeUp();
+
+signals:
+    void finished();
+
+public slots:
+    void run();
+    void quit();
+
+private:
+    QkArchive *m_archive;
+    bool m_quit;
+    QAtomicInt m_wake;
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+};
+
+/**
+ * Append-only on-disk sample archive. Every (source, device address) pair
+ * gets a directory of fixed-size segments; a segment is one memory-mapped
+ * timestamp file plus one memory-mapped file per channel. A source is a
+ * connection, registered with addSource(), so devices with the same
+ * address on different links never share a stream.
+ *
+ * A stream is opened by the first append() for it, on the writer's thread:
+ * its first segment and a spare are created there, so no sample is lost
+ * while the worker catches up. From then on append() only stores into
+ * mapped memory; the background worker keeps a spare segment ready and
+ * writes dirty pages back. Only if the worker fell a whole segment behind
+ * (or the channel count changes) does append() create the next segment
+ * itself. Samples are dropped, and counted in droppedSamples(), only when
+ * segment files cannot be created.
+ *
+ * Range queries read straight from the mappings. Timestamps are expected
+ * to be non-decreasing per stream.
+ */
+class QKLIBSHARED_EXPORT QkArchive : public QObject
+{
+    Q_OBJECT
+    friend class QkArchiveWorker;
+public:
+    enum
+    {
+        DefaultSegmentRows = 65536,
+        IndexStride = 256,
+        FlushInterval = 1000 // ms
+    };
+
+    QkArchive(const QString &path, QObject *parent = 0);
+    ~QkArchive();
+
+    QString path() { return m_path; }
+    void setSegmentRows(int rows);
+    int segmentRows() { return m_segmentRows.load(); }
+
+    int addSource(const QString &name);
+    QStringList sources();
+
+    void append(int source, int address, const float *values, int count, quint64 timestamp);
+    int query(int source, int address, int channel, quint64 from, quint64 to,
+              QVector<quint64> *timestamps, QVector<float> *values);
+    int droppedSamples() { return m_droppedSamples.load(); }
+
+private:
+    class Header
+    {
+    public:
+        quint32 magic;
+        quint32 channels;
+        quint32 rows;
+        quint32 count;
+    };
+
+    class Segment
+    {
+    public:
+        int number;
+        int channels;
+        int rows;
+        QFile *timeFile;
+        QList<QFile*> columnFiles;
+        Header *header;
+        quint64 *timestamps;
+        QVector<float*> columns;
+        QVector<quint64> index; // timestamp of every IndexStride-th row
+        QAtomicInt count;
+        int flushed;
+    };
+
+    typedef QPair<int, int> Key; // source, address
+
+    class Stream
+    {
+    public:
+        Key key;
+        QString dir;
+        QList<Segment*> segments; // m_lock; includes the spare while it is empty
+        Segment *active; // writer only
+        QAtomicPointer<Segment> spare; // handed from the worker to the writer
+        QAtomicInt channels; // wanted by the writer for the next segment
+        QAtomicInt next; // number of the next segment
+    };
+
+    QString streamDir(const Key &key);
+    Stream* openStream(const Key &key, int channels);
+    Segment* createSegment(Stream *stream, int channels);
+    Segment* rotate(Stream *stream, int channels);
+    void loadSegments(Stream *stream);
+    Segment* openSegment(const QString &dir, int number, int channels, bool create);
+    void closeSegment(Segment *segment, bool remove = false);
+    int lowerBound(Segment *segment, int count, quint64 timestamp);
+    int query(Stream *stream, int channel, quint64 from, quint64 to,
+              QVector<quint64> *timestamps, QVector<float> *values);
+
+    // worker thread
+    void flush();
+    void prepare();
+
+    QString m_path;
+    QAtomicInt m_segmentRows;
+    QStringList m_sources; // m_sourcesMutex
+    QMutex m_sourcesMutex;
+    QHash<Key, Stream*> m_streams; // m_lock; only the writer inserts
+    QReadWriteLock m_lock;
+
+    QHash<Key, Stream*> m_writerStreams; // writer only
+    QAtomicInt m_droppedSamples;
+
+    QThread *m_workerThread;
+    QkArchiveWorker *m_worker;
+};
+
+#endif // QKARCHIVE_H
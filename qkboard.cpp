@@ -124,9 +124,29 @@ void QkBoard::setConfigValue(int idx, QVariant value)
 
 int QkBoard::update()
 {
-    int i;
     QkAck ack;
+
+    // The requests are pipelined through the protocol window, the ACKs are
+    // collected in order.
+    foreach(QkRequestPtr request, updateAsync())
+    {
+        ack = request->waitForFinished();
+        if(ack.result != QkAck::ACK_OK)
+        {
+            qDebug() << "failed to update board" << ack.result;
+            return ack.toInt();
+        }
+    }
+
+    return ack.toInt();
+}
+
+QList<QkRequestPtr> QkBoard::updateAsync()
+{
+    int i;
     QkPacket::Descriptor pd;
+    QList<QkRequestPtr> requests;
+    QkProtocol *protocol = m_qk->protocol();
 
     pd.board = this;
     pd.boardType = m_type;
@@ -134,28 +154,19 @@ int QkBoard::update()
 
     pd.code = QK_PACKET_CODE_SETNAME;
     pd.setname_str = name();
-    ack = m_qk->protocol()->sendPacket(pd);
-    if(ack.result != QkAck::ACK_OK)
-    {
-        qDebug() << "failed to set name" << ack.result;
-        return ack.toInt();
-    }
+    requests.append(protocol->sendPacketAsync(pd));
 
     pd.code = QK_PACKET_CODE_SETCONFIG;
     for(i = 0; i < configs().count(); i++)
     {
         pd.setconfig_idx = i;
-        ack = m_qk->protocol()->sendPacket(pd);
-        if(ack.result != QkAck::ACK_OK)
-            return ack.toInt();
+        requests.append(protocol->sendPacketAsync(pd));
     }
 
     pd.code = QK_PACKET_CODE_SETSAMP;
-    ack = m_qk->protocol()->sendPacket(pd);
-    if(ack.result != QkAck::ACK_OK)
-        return ack.toInt();
+    requests.append(protocol->sendPacketAsync(pd));
 
-    return ack.toInt();
+    return requests;
 }
 
 int QkBoard::save()
@@ -27,10 +27,14 @@
 #include <QObject>
 #include <QVariant>
 #include <QVector>
+#include <QSharedPointer>
 
 class QkCore;
 class QkNode;
 class QkCore;
+class QkRequest;
+
+typedef QSharedPointer<QkRequest> QkRequestPtr;
 
 using namespace QkUtils;
 
@@ -104,6 +108,7 @@ public:
 
     int save();
     int update();
+    QList<QkRequestPtr> updateAsync();
 
     int address();
     QString name();
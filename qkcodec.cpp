@@ -0,0 +1,91 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkcodec.h"
+
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void QkCodec::decodeSamples(const char *src, int count, bool integer, float *dst)
+{
+    int i = 0;
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if(!integer)
+    {
+        // little-endian IEEE 754 lanes are already host floats
+        memcpy(dst, src, count * sizeof(float));
+        return;
+    }
+#if defined(__SSE2__)
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*) (src + 4*i));
+        const __m128i b = _mm_loadu_si128((const __m128i*) (src + 4*i + 16));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(a));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(b));
+    }
+    for(; i + 4 <= count; i += 4)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*) (src + 4*i));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(a));
+    }
+#endif
+#endif
+
+    int value;
+    for(; i < count; i++)
+    {
+        if(integer)
+        {
+            SInt<4>::decode(src + 4*i, &value);
+            dst[i] = (float) value;
+        }
+        else
+            Float::decode(src + 4*i, dst + i);
+    }
+}
+
+void QkCodec::decodeInts(const char *src, int count, qint32 *dst)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    memcpy(dst, src, count * sizeof(qint32));
+#else
+    int value;
+    for(int i = 0; i < count; i++)
+    {
+        SInt<4>::decode(src + 4*i, &value);
+        dst[i] = value;
+    }
+#endif
+}
+
+bool QkCodec::readString(const char *data, int count, int *idx, QString *value)
+{
+    if(*idx < 0 || *idx >= count)
+        return false;
+    const char *end = (const char*) memchr(data + *idx, 0, count - *idx);
+    if(end == 0)
+        return false;
+    *value = QString::fromLatin1(data + *idx, end - (data + *idx));
+    *idx = end - data + 1;
+    return true;
+}
@@ -0,0 +1,166 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKCODEC_H
+#define QKCODEC_H
+
+#include "qkcore_lib.h"
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+#include <string.h>
+
+/**
+ * Fixed-size little-endian field codecs. A packet layout is declared once as
+ * QkCodec::Layout<Field...>; its Size is known at compile time and the same
+ * declaration is used to encode (build) and decode (parse) the packet.
+ */
+namespace QkCodec
+{
+
+template<int N, bool Signed = false>
+struct Int
+{
+    typedef int Type;
+    enum { Size = N };
+
+    static void encode(char *p, int value)
+    {
+        for(int i = 0; i < N; i++)
+            p[i] = (char) ((quint32) value >> (8*i));
+    }
+    static void decode(const char *p, int *value)
+    {
+        quint32 v = 0;
+        for(int i = 0; i < N; i++)
+            v |= (quint32) (quint8) p[i] << (8*i);
+        if(Signed && N < 4 && (v & (1u << (8*N - 1))))
+            v |= ~0u << (8*N);
+        *value = (int) v;
+    }
+};
+
+template<int N> struct UInt : Int<N, false> {};
+template<int N> struct SInt : Int<N, true> {};
+
+struct Float
+{
+    typedef float Type;
+    enum { Size = 4 };
+
+    static void encode(char *p, float value)
+    {
+        quint32 v;
+        memcpy(&v, &value, sizeof(v));
+        Int<4>::encode(p, (int) v);
+    }
+    static void decode(const char *p, float *value)
+    {
+        int v;
+        Int<4>::decode(p, &v);
+        memcpy(value, &v, sizeof(*value));
+    }
+};
+
+// NUL padded string occupying exactly N bytes
+template<int N>
+struct String
+{
+    typedef QString Type;
+    enum { Size = N };
+
+    static void encode(char *p, const QString &value)
+    {
+        QByteArray bytes = value.toLatin1();
+        int count = qMin(bytes.count(), N);
+        memcpy(p, bytes.constData(), count);
+        memset(p + count, 0, N - count);
+    }
+    static void decode(const char *p, QString *value)
+    {
+        *value = QString::fromLatin1(p, qstrnlen(p, N));
+    }
+};
+
+template<typename... Fields>
+struct Layout;
+
+template<>
+struct Layout<>
+{
+    enum { Size = 0 };
+
+    static void encode(char *) {}
+    static void decode(const char *) {}
+};
+
+template<typename F, typename... Rest>
+struct Layout<F, Rest...>
+{
+    enum { Size = F::Size + Layout<Rest...>::Size };
+
+    static void encode(char *p, const typename F::Type &value, const typename Rest::Type&... rest)
+    {
+        F::encode(p, value);
+        Layout<Rest...>::encode(p + F::Size, rest...);
+    }
+    static void decode(const char *p, typename F::Type *value, typename Rest::Type*... rest)
+    {
+        F::decode(p, value);
+        Layout<Rest...>::decode(p + F::Size, rest...);
+    }
+};
+
+// Appends L::Size bytes to data (one resize, no per-field growth).
+template<typename L, typename... Args>
+void append(QByteArray *data, const Args&... values)
+{
+    int offset = data->count();
+    data->resize(offset + L::Size);
+    L::encode(data->data() + offset, values...);
+}
+
+// Decodes L at data[*idx], checking the whole layout fits in data[0, count)
+// before reading any field.
+template<typename L, typename... Args>
+bool read(const char *data, int count, int *idx, Args*... values)
+{
+    if(*idx < 0 || count - *idx < (int) L::Size)
+        return false;
+    L::decode(data + *idx, values...);
+    *idx += L::Size;
+    return true;
+}
+
+// Decodes a NUL terminated string at data[*idx]. Fails, leaving *idx alone,
+// when the NUL is not within data[0, count).
+QKLIBSHARED_EXPORT bool readString(const char *data, int count, int *idx, QString *value);
+
+// Converts count little-endian int32 (integer) or float32 lanes at src to
+// host floats at dst in one pass, vectorized where the target allows it.
+QKLIBSHARED_EXPORT void decodeSamples(const char *src, int count, bool integer, float *dst);
+
+// Copies count little-endian int32 lanes at src to dst as they are, for
+// integer channels that must not lose precision through float.
+QKLIBSHARED_EXPORT void decodeInts(const char *src, int count, qint32 *dst);
+
+} // namespace QkCodec
+
+#endif // QKCODEC_H
@@ -20,6 +20,7 @@
 #include "qkconnect.h"
 #include "qkcore.h"
 #include "qkconnserial.h"
+#include "qkconntcp.h"
 
 #include <QDebug>
 #include <QtSerialPort/QSerialPortInfo>
@@ -28,27 +29,304 @@
 #include <QQueue>
 #include <QEventLoop>
 #include <QTimer>
+#include <QAbstractEventDispatcher>
+#include <QDateTime>
+
+#include <string.h>
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <errno.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 int QkConnection::nextId = 0;
 
+static inline bool isControlByte(quint8 ch)
+{
+    return (ch == QK_COMM_FLAG || ch == QK_COMM_DLE);
+}
+
+// Returns the first FLAG or DLE byte in [p, end), or end if there is none.
+static const char* findControlByte(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i flag = _mm_set1_epi8((char) QK_COMM_FLAG);
+    const __m128i dle = _mm_set1_epi8((char) QK_COMM_DLE);
+    while(end - p >= 16)
+    {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, flag),
+                                                  _mm_cmpeq_epi8(chunk, dle)));
+        if(mask != 0)
+        {
+            while(!(mask & 1))
+            {
+                mask >>= 1;
+                p++;
+            }
+            return p;
+        }
+        p += 16;
+    }
+#endif
+    while(p < end && !isControlByte((quint8) *p))
+        p++;
+    return p;
+}
+
 QkConnWorker::QkConnWorker(QkConnection *conn)
 {
     m_conn = conn;
     m_quit = false;
     m_connected = false;
+    m_txBuffer.reserve(1024);
+    m_txOffset = 0;
+    m_rxBuffer.resize(4096);
+}
+
+// Runs on the worker thread. Without a reactor that thread is the link's
+// own and run() services it; with one the thread only opens the device,
+// which can block on a TCP connect or the serial reset pulses, and hands
+// it to the reactor.
+void QkConnWorker::start()
+{
+    QkReactor *reactor = m_conn->reactor();
+    if(reactor == 0)
+    {
+        run();
+        return;
+    }
+
+    m_protocol = Protocol();
+    if(!m_quit && openDevice())
+    {
+        if(m_quit)
+            closeDevice();
+        else
+        {
+            // the reactor never runs a Qt event loop, so the device's own
+            // notifiers stay quiet there and it is closed on that thread
+            device()->moveToThread(reactor->thread());
+            reactor->add(this);
+        }
+    }
+    emit finished();
+}
+
+bool QkConnWorker::attach()
+{
+    m_connected = true;
+    emit connected(m_conn->id());
+    return true;
+}
+
+void QkConnWorker::detach()
+{
+    closeDevice();
+    m_txBuffer.resize(0);
+    m_txOffset = 0;
+    m_connected = false;
+    emit disconnected(m_conn->id());
+}
+
+void QkConnWorker::hangUp()
+{
+    // Same way out as a link closed under a threaded worker: an error,
+    // then disconnected() once the device is closed in detach().
+    emit error(tr("Connection closed"));
+    reactor()->remove(this);
+}
+
+void QkConnWorker::readable()
+{
+#ifdef Q_OS_UNIX
+    // The descriptor is non-blocking: read until it runs dry, straight into
+    // the reusable buffer.
+    const int fd = descriptor();
+    ssize_t count;
+    while((count = ::read(fd, m_rxBuffer.data(), m_rxBuffer.size())) > 0)
+        parseData(m_rxBuffer.constData(), (int) count);
+#endif
+}
+
+bool QkConnWorker::wantsWrite()
+{
+    return m_txOffset < m_txBuffer.size();
+}
+
+int QkConnWorker::service()
+{
+#ifdef Q_OS_UNIX
+    // Same batching as the threaded workers; a short write keeps the rest
+    // of the buffer until the descriptor is writable again.
+    const int fd = descriptor();
+    forever
+    {
+        if(m_txOffset >= m_txBuffer.size())
+        {
+            m_txOffset = 0;
+            if(encodePending() == 0)
+                break;
+        }
+
+        ssize_t count = ::write(fd, m_txBuffer.constData() + m_txOffset, m_txBuffer.size() - m_txOffset);
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                qWarning() << __FUNCTION__ << "write failed, frames dropped";
+                m_txBuffer.resize(0);
+                m_txOffset = 0;
+            }
+            break;
+        }
+        m_txOffset += (int) count;
+    }
+#endif
+    return -1;
 }
 
 void QkConnWorker::quit()
 {
     m_quit = true;
+    wakeUp();
 }
 
 void QkConnWorker::sendFrame(const QkFrame &frame)
 {
-    QMutexLocker locker(&m_mutex);
-//    qDebug() << "sendFrame enqueue";
-    m_outputFramesQueue.enqueue(frame);
+    // Only the protocol worker sends, so the ring has a single producer.
+    if(!m_txRing.put(frame))
+        qWarning() << __FUNCTION__ << "tx queue full, frame dropped";
+    wakeUp();
+}
+
+int QkConnWorker::encodePending()
+{
+    // Stuffs every queued frame into m_txBuffer, to be handed to the port
+    // with a single write. Returns the number of frames.
+    int count = 0;
+    QkFrame *frame;
+
+    m_txBuffer.resize(0);
+    while((frame = m_txRing.front()) != 0)
+    {
+        encodeFrame(frame->data, &m_txBuffer);
+        m_txRing.pop();
+        count++;
+    }
+    if(count > 0)
+        m_framesSent.fetchAndAddRelaxed(count);
+    return count;
+}
+
+void QkConnWorker::parseData(const char *data, int count)
+{
+    // Same state machine as the original byte-by-byte parser, but runs of
+    // plain bytes between FLAG/DLE are located in bulk and copied at once.
+    const char *p = data;
+    const char *end = data + count;
+    QByteArray &buf = m_protocol.frame;
+    int &flags = m_protocol.ctrlFlags;
+
+    while(p < end)
+    {
+        if(!FLAG(flags, Protocol::cfReceiving))
+        {
+            // Out of sync: everything up to the opening FLAG is discarded.
+            p = (const char*) memchr(p, QK_COMM_FLAG, end - p);
+            if(p == 0)
+                return;
+            p++;
+            buf.resize(0);
+            FLAG_SET(flags, Protocol::cfReceiving);
+            FLAG_SET(flags, Protocol::cfValid);
+            FLAG_CLR(flags, Protocol::cfDataLinkEscape);
+            continue;
+        }
+
+        if(FLAG(flags, Protocol::cfDataLinkEscape))
+        {
+            buf.append(*p++);
+            FLAG_CLR(flags, Protocol::cfDataLinkEscape);
+        }
+        else
+        {
+            const char *ctrl = findControlByte(p, end);
+            if(ctrl > p)
+                buf.append(p, ctrl - p);
+            p = ctrl;
+            if(p == end)
+                break;
+
+            if((quint8) *p == QK_COMM_DLE)
+                FLAG_SET(flags, Protocol::cfDataLinkEscape);
+            else if(buf.count() > 0)
+            {
+                m_framesReceived.ref();
+                QkFrame frame;
+                frame.data = buf;
+                frame.timestamp = QDateTime::currentMSecsSinceEpoch();
+                FLAG_CLR(flags, Protocol::cfReceiving);
+                FLAG_CLR(flags, Protocol::cfValid);
+                emit frameReady(frame);
+            }
+            p++;
+        }
+
+        if(buf.count() > QK_FRAME_MAX_SIZE)
+        {
+            // A FLAG was lost: drop the frame and resync on the next one.
+            m_oversizedFrames.ref();
+            qWarning() << __FUNCTION__ << "frame too long, dropped";
+            buf.resize(0);
+            FLAG_CLR(flags, Protocol::cfReceiving);
+            FLAG_CLR(flags, Protocol::cfValid);
+            FLAG_CLR(flags, Protocol::cfDataLinkEscape);
+        }
+    }
+}
+
+void QkConnWorker::encodeFrame(const QByteArray &frame, QByteArray *out)
+{
+    // Byte-stuff the frame straight into the output buffer, sized for the
+    // worst case (every byte escaped) and trimmed afterwards.
+    const int start = out->size();
+    out->resize(start + 2*frame.size() + 2);
+
+    char *dst = out->data() + start;
+    const char *src = frame.constData();
+    const char *end = src + frame.size();
+
+    *dst++ = (char) QK_COMM_FLAG;
+    while(src < end)
+    {
+        const quint8 ch = (quint8) *src;
+        if(ch == QK_COMM_FLAG || ch == QK_COMM_DLE)
+            *dst++ = (char) QK_COMM_DLE;
+        *dst++ = *src++;
+    }
+    *dst++ = (char) QK_COMM_FLAG;
+
+    out->resize(dst - out->constData());
+}
+
+void QkConnWorker::wakeUp()
+{
+    if(reactor() != 0)
+    {
+        reactor()->wakeUp(this);
+        return;
+    }
+    // The worker sleeps inside its thread's event dispatcher (blocked on the
+    // port's descriptor), so it has to be kicked when there is work to do.
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance(thread());
+    if(dispatcher != 0)
+        dispatcher->wakeUp();
 }
 
 QString QkConnection::typeToString(Type type)
@@ -67,6 +345,7 @@ QkConnection::QkConnection(QObject *parent) :
     m_qk = new QkCore(this);
     m_id = QkConnection::nextId++;
     m_searchOnConnect = false;
+    m_reactor = 0;
 
     connect(this, SIGNAL(connected(int)), this, SLOT(slotConnected()));
     connect(this, SIGNAL(disconnected(int)), this, SLOT(slotDisconnected()));
@@ -85,17 +364,68 @@ bool QkConnection::isConnected()
     return false;
 }
 
+QkConnection::Statistics QkConnection::statistics()
+{
+    Statistics stats;
+    QkProtocolWorker *protocolWorker = m_qk->protocol()->worker();
+
+    if(m_worker != 0)
+    {
+        stats.framesReceived = m_worker->framesReceived();
+        stats.framesSent = m_worker->framesSent();
+        stats.oversizedFrames = m_worker->oversizedFrames();
+        stats.txQueueHighWater = m_worker->txQueueHighWater();
+        stats.txQueueOverflows = m_worker->txQueueOverflows();
+    }
+    stats.malformedFrames = protocolWorker->malformedFrames();
+    stats.checksumErrors = protocolWorker->checksumErrors();
+    stats.droppedFragments = protocolWorker->droppedFragments();
+    stats.inputQueueHighWater = protocolWorker->inputQueueHighWater();
+    stats.inputQueueOverflows = protocolWorker->inputQueueOverflows();
+    stats.outputQueueHighWater = protocolWorker->outputQueueHighWater();
+    stats.latePackets = protocolWorker->latePackets();
+
+    return stats;
+}
+
+void QkConnection::setVerifyChecksum(bool enabled)
+{
+    m_qk->protocol()->setVerifyChecksum(enabled);
+}
+
+bool QkConnection::verifyChecksum()
+{
+    return m_qk->protocol()->verifyChecksum();
+}
+
 void QkConnection::open()
 {
     emit status(m_id, sConnecting);
     m_qk->reset();
+    if(m_reactor != 0)
+    {
+        QkProtocol *protocol = m_qk->protocol();
+        protocol->_stopWorkerThread();
+        m_reactor->add(protocol->worker());
+    }
     if(m_workerThread != 0)
+    {
+        m_worker->_setQuit(false);
         m_workerThread->start();
+    }
 }
 
 void QkConnection::close()
 {
-    if(m_workerThread != 0 && m_worker != 0)
+    if(m_reactor != 0)
+    {
+        // the device may still be opening on the worker thread
+        m_worker->quit();
+        m_workerThread->wait();
+        m_reactor->remove(m_worker);
+        m_reactor->remove(m_qk->protocol()->worker());
+    }
+    else if(m_workerThread != 0 && m_worker != 0)
     {
         m_worker->quit();
         m_workerThread->quit();
@@ -118,6 +448,9 @@ void QkConnection::slotConnected()
 
 void QkConnection::slotDisconnected()
 {
+    // a reactor link that hung up leaves the protocol side attached
+    if(m_reactor != 0)
+        m_reactor->remove(m_qk->protocol()->worker());
     emit status(m_id, sDisconnected);
 }
 
@@ -144,6 +477,36 @@ QkConnectionManager::QkConnectionManager(QObject *parent) :
 QkConnectionManager::~QkConnectionManager()
 {
     qDeleteAll(m_connections.begin(), m_connections.end());
+    setReactorThreads(0);
+}
+
+// With count > 0, connections added from now on share count reactor
+// threads (each goes to the least loaded one) instead of getting two
+// threads of their own. Set it before adding connections.
+void QkConnectionManager::setReactorThreads(int count)
+{
+    while(m_reactors.count() > count)
+    {
+        QkReactor *reactor = m_reactors.takeLast();
+        QThread *thread = m_reactorThreads.takeLast();
+        reactor->quit();
+        thread->wait();
+        delete reactor;
+    }
+    while(m_reactors.count() < count)
+    {
+        QThread *thread = new QThread(this);
+        QkReactor *reactor = new QkReactor();
+        reactor->moveToThread(thread);
+
+        connect(thread, SIGNAL(started()), reactor, SLOT(run()), Qt::DirectConnection);
+        connect(reactor, SIGNAL(finished()), thread, SLOT(quit()), Qt::DirectConnection);
+        connect(reactor, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
+
+        m_reactors.append(reactor);
+        m_reactorThreads.append(thread);
+        thread->start();
+    }
 }
 
 QList<QkConnection*> QkConnectionManager::connections()
@@ -187,12 +550,27 @@ QkConnection* QkConnectionManager::addConnection(const QkConnection::Descriptor
                                 this);
 
         break;
+    case QkConnection::tTCP:
+        conn = new QkConnTcp(desc.parameters["host"].toString(),
+                             desc.parameters["port"].toInt(),
+                             this);
+        break;
     default:
         qDebug() << "Connection type unknown" << desc.type;
         return 0;
     }
 
     conn->setSearchOnConnect(m_searchOnConnect);
+    conn->setVerifyChecksum(desc.parameters.value("verifyChecksum").toBool());
+
+    if(!m_reactors.isEmpty())
+    {
+        QkReactor *reactor = m_reactors.first();
+        foreach(QkReactor *r, m_reactors)
+            if(r->count() < reactor->count())
+                reactor = r;
+        conn->_setReactor(reactor);
+    }
 
 
     connect(conn, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
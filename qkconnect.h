@@ -28,43 +28,99 @@
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QAtomicInt>
 
 #include "qkcore.h"
 #include "qkutils.h"
+#include "qkreactor.h"
+#include "qkring.h"
 
 class QReadWriteLock;
 class QkConnection;
 
-class QkConnWorker : public QObject
+class QkConnWorker : public QObject, public QkReactor::Source
 {
 Q_OBJECT
 public:
+    class Protocol
+    {
+    public:
+        enum ControlFlag
+        {
+            cfTramsmiting = MASK(1, 0),
+            cfReceiving = MASK(1, 1),
+            cfFrameReady = MASK(1, 2),
+            cfDataLinkEscape = MASK(1, 3),
+            cfValid = MASK(1, 4)
+        };
+
+        Protocol()
+        {
+            frame.reserve(QK_FRAME_MAX_SIZE);
+            ctrlFlags = 0;
+            bytesRead = 0;
+        }
+
+        QByteArray frame;
+        int ctrlFlags;
+        int bytesRead;
+    };
+
     QkConnWorker(QkConnection *conn);
 
     bool isConnected() { return m_connected; }
+    int framesReceived() { return m_framesReceived.load(); }
+    int framesSent() { return m_framesSent.load(); }
+    int oversizedFrames() { return m_oversizedFrames.load(); }
+    int txQueueHighWater() { return m_txRing.highWater(); }
+    int txQueueOverflows() { return m_txRing.overflows(); }
+    void _setQuit(bool quit) { m_quit = quit; }
+
+    // driven by a QkReactor instead of run()
+    bool attach();
+    void detach();
+    void readable();
+    bool wantsWrite();
+    int service();
+    void hangUp();
 
 signals:
-    void frameReady(QkFrame);
+    void frameReady(const QkFrame &frame);
     void connected(int);
     void disconnected(int);
     void finished();
     void error(QString);
 
 public slots:
+    void start();
     virtual void run() = 0;
     void quit();
     void sendFrame(const QkFrame &frame);
 
 protected:
+    virtual bool openDevice() = 0;
+    virtual void closeDevice() = 0;
+    virtual QIODevice* device() = 0;
+
     QkConnection *connection() { return m_conn; }
+    void wakeUp();
+    void parseData(const char *data, int count);
+    int encodePending();
+    static void encodeFrame(const QByteArray &frame, QByteArray *out);
 
 protected:
-    QkFrameQueue m_outputFramesQueue;
+    QkRing<QkFrame> m_txRing;
+    QByteArray m_txBuffer;
+    int m_txOffset;
+    QByteArray m_rxBuffer;
+    Protocol m_protocol;
 //    QkFrameQueue m_inputFrames;
     bool m_quit;
     bool m_connected;
+    QAtomicInt m_framesReceived;
+    QAtomicInt m_framesSent;
+    QAtomicInt m_oversizedFrames;
 
-    QMutex m_mutex;
     QWaitCondition m_condition;
 
 private:
@@ -98,6 +154,38 @@ public:
         bool operator==(Descriptor &other);
     };
 
+    class Statistics
+    {
+    public:
+        Statistics()
+        {
+            framesReceived = 0;
+            framesSent = 0;
+            oversizedFrames = 0;
+            malformedFrames = 0;
+            checksumErrors = 0;
+            droppedFragments = 0;
+            inputQueueHighWater = 0;
+            inputQueueOverflows = 0;
+            outputQueueHighWater = 0;
+            latePackets = 0;
+            txQueueHighWater = 0;
+            txQueueOverflows = 0;
+        }
+        int framesReceived;
+        int framesSent;
+        int oversizedFrames;
+        int malformedFrames;
+        int checksumErrors;
+        int droppedFragments;
+        int inputQueueHighWater;
+        int inputQueueOverflows;
+        int outputQueueHighWater;
+        int latePackets;
+        int txQueueHighWater;
+        int txQueueOverflows;
+    };
+
     static QString typeToString(Type type);
 
     QkConnection(QObject *parent = 0);
@@ -110,8 +198,13 @@ public:
     int id() { return m_id; }
     QkConnWorker* worker() { return m_worker; }
     bool isConnected();
+    Statistics statistics();
 
     void setSearchOnConnect(bool enabled) { m_searchOnConnect = enabled; }
+    void setVerifyChecksum(bool enabled);
+    bool verifyChecksum();
+    void _setReactor(QkReactor *reactor) { m_reactor = reactor; }
+    QkReactor* reactor() { return m_reactor; }
     bool operator==(QkConnection &other);
 
     virtual bool sameAs(const Descriptor &desc) = 0;
@@ -136,6 +229,7 @@ protected:
     QkCore *m_qk;
     QThread *m_workerThread;
     QkConnWorker *m_worker;
+    QkReactor *m_reactor;
 
 private:
     static int nextId;
@@ -152,6 +246,8 @@ public:
 
     void setSearchOnConnect(bool search) { m_searchOnConnect = search; }
     bool searchOnConnect() { return m_searchOnConnect; }
+    void setReactorThreads(int count);
+    int reactorThreads() { return m_reactors.count(); }
 
     QList<QkConnection*> connections();
     QkConnection* defaultConnection();
@@ -173,6 +269,8 @@ private slots:
 
 private:
     QList<QkConnection*> m_connections;
+    QList<QkReactor*> m_reactors;
+    QList<QThread*> m_reactorThreads;
     bool m_searchOnConnect;
 };
 
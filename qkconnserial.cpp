@@ -31,17 +31,22 @@
 QkConnSerialWorker::QkConnSerialWorker(QkConnSerial *conn) :
     QkConnWorker(conn)
 {
-
+    m_sp = 0;
 }
 
-void QkConnSerialWorker::run()
+int QkConnSerialWorker::descriptor()
 {
-    QEventLoop eventLoop;
-
-    m_sp = new QSerialPort(this);
-    m_protocol = new Protocol();
+#ifdef Q_OS_UNIX
+    if(m_sp != 0)
+        return m_sp->handle();
+#endif
+    return -1;
+}
 
-    connect(m_sp, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+bool QkConnSerialWorker::openDevice()
+{
+    // No parent: in reactor mode the port is moved to the reactor thread.
+    m_sp = new QSerialPort();
 
     QkConnection::Descriptor desc = connection()->descriptor();
 
@@ -86,51 +91,52 @@ void QkConnSerialWorker::run()
     else
     {
         emit error(tr("Failed to open serial port ") + m_sp->portName() + m_sp->errorString());
-        return;
+        delete m_sp;
+        m_sp = 0;
+        return false;
     }
+    return true;
+}
+
+void QkConnSerialWorker::closeDevice()
+{
+    if(m_sp != 0)
+    {
+        m_sp->close();
+        delete m_sp;
+        m_sp = 0;
+    }
+}
+
+void QkConnSerialWorker::run()
+{
+    QEventLoop eventLoop;
+
+    m_protocol = Protocol();
+    if(!openDevice())
+        return;
+
+    connect(m_sp, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
 
     m_connected = true;
     emit connected(connection()->id());
 
-    QString dbgStr;
-
     while(!m_quit)
     {
-        eventLoop.processEvents();
+        // Sleep until the port has data, a frame is queued or quit() is called.
+        eventLoop.processEvents(QEventLoop::WaitForMoreEvents);
 
-        m_mutex.lock();
-        if(m_outputFramesQueue.count() > 0)
-        {
-            const QByteArray &frame = m_outputFramesQueue.dequeue().data;
-            m_mutex.unlock();
-
-            dbgStr = "";
-
-            int i;
-            quint8 chBuf;
-
-            const char flagByte = QK_COMM_FLAG;
-            const char dleByte = QK_COMM_DLE;
-
-            m_sp->write(&flagByte, 1); dbgStr += QString().sprintf("%02X ", flagByte);
-            for(i = 0; i < frame.count(); i++)
-            {
-                chBuf = frame[i] & 0xFF;
-                if(chBuf == QK_COMM_FLAG || chBuf == QK_COMM_DLE)
-                {
-                    m_sp->write(&dleByte, 1); dbgStr += QString().sprintf("%02X ", dleByte);
-                }
-                m_sp->write((char*) &chBuf, 1); dbgStr += QString().sprintf("%02X ", chBuf);
-            }
-            m_sp->write(&flagByte, 1); dbgStr += QString().sprintf("%02X ", flagByte);
-
-            qDebug() << "tx: " << dbgStr;
-        }
-        else
-            m_mutex.unlock();
+        if(encodePending() == 0)
+            continue;
+
+        m_sp->write(m_txBuffer);
+
+#ifdef QK_DEBUG_FRAMES
+        qDebug() << "tx: " << m_txBuffer.toHex();
+#endif
     }
 
-    m_sp->close();
+    closeDevice();
     m_connected = false;
 
     emit disconnected(connection()->id());
@@ -146,82 +152,19 @@ void QkConnSerialWorker::setBootPol(bool state)
 
 void QkConnSerialWorker::slotReadyRead()
 {
-    QByteArray data;// = m_sp->readAll();
-    char *bufPtr;// = data.data();
-    int countBytes;// = data.count();
-    QString dbgStr;
+    qint64 count;
 
-//    while(countBytes--)
     while(m_sp->bytesAvailable() > 0)
     {
-        data = m_sp->readAll();
-        bufPtr = data.data();
-        countBytes = data.count();
-
-        while(countBytes--)
-        {
-
-            //        qDebug() << "rx:" << QString().sprintf("%02X (%c)", *bufPtr & 0xFF, *bufPtr & 0xFF);
-            dbgStr.append( QString().sprintf("%02X ", *bufPtr & 0xFF) );
-//            dbgStr.append( QString().sprintf("%c", *bufPtr & 0xFF) );
-            parseSerialData((quint8)*bufPtr++);
-            if(FLAG(m_protocol->ctrlFlags, Protocol::cfFrameReady))
-            {
-                QkFrame frame;
-                frame.data = m_protocol->frame;
-                frame.timestamp = QDateTime::currentMSecsSinceEpoch();
-                emit frameReady(frame);
-                FLAG_CLR(m_protocol->ctrlFlags, Protocol::cfFrameReady);
-            }
-        }
+        count = m_sp->read(m_rxBuffer.data(), m_rxBuffer.size());
+        if(count <= 0)
+            break;
+
+#ifdef QK_DEBUG_FRAMES
+        qDebug() << "rx: " << QByteArray::fromRawData(m_rxBuffer.constData(), count).toHex();
+#endif
+        parseData(m_rxBuffer.constData(), (int) count);
     }
-    qDebug() << "rx: " << dbgStr;
-//    qDebug("%s", dbgStr.toStdString().c_str());
-}
-
-void QkConnSerialWorker::parseSerialData(quint8 data)
-{
-    switch(data)
-    {
-    case QK_COMM_FLAG:
-        if(!FLAG(m_protocol->ctrlFlags, Protocol::cfDataLinkEscape))
-        {
-            if(!FLAG(m_protocol->ctrlFlags, Protocol::cfReceiving))
-            {
-                m_protocol->frame.clear();
-                FLAG_SET(m_protocol->ctrlFlags, Protocol::cfReceiving);
-                FLAG_SET(m_protocol->ctrlFlags, Protocol::cfValid);
-            }
-            else
-            {
-                if(FLAG(m_protocol->ctrlFlags, Protocol::cfValid) &&
-                   m_protocol->frame.count() > 0)
-                {
-                    FLAG_SET(m_protocol->ctrlFlags, Protocol::cfFrameReady);
-                    FLAG_CLR(m_protocol->ctrlFlags, Protocol::cfReceiving);
-                    FLAG_CLR(m_protocol->ctrlFlags, Protocol::cfValid);
-                }
-            }
-            return;
-        }
-        break;
-    case QK_COMM_DLE:
-        if(FLAG(m_protocol->ctrlFlags, Protocol::cfValid))
-        {
-            if(!FLAG(m_protocol->ctrlFlags, Protocol::cfDataLinkEscape))
-            {
-                FLAG_SET(m_protocol->ctrlFlags, Protocol::cfDataLinkEscape);
-                return;
-            }
-        }
-        break;
-    default: ;
-    }
-
-    if(FLAG(m_protocol->ctrlFlags, Protocol::cfValid))
-        m_protocol->frame.append(data);
-
-    FLAG_CLR(m_protocol->ctrlFlags, Protocol::cfDataLinkEscape);
 }
 
 QkConnSerial::QkConnSerial(QObject *parent)
@@ -244,17 +187,18 @@ QkConnSerial::QkConnSerial(const QString &portName, int baudRate, bool bootPol,
     ((QkConnSerialWorker *)m_worker)->setBootPol(m_bootPol);
     m_worker->moveToThread(m_workerThread);
 
-    connect(m_workerThread, SIGNAL(started()), m_worker, SLOT(run()), Qt::DirectConnection);
+    connect(m_workerThread, SIGNAL(started()), m_worker, SLOT(start()), Qt::DirectConnection);
     connect(m_worker, SIGNAL(finished()), m_workerThread, SLOT(quit()), Qt::DirectConnection);
 
     connect(m_worker, SIGNAL(connected(int)), this, SIGNAL(connected(int)), Qt::DirectConnection);
     connect(m_worker, SIGNAL(disconnected(int)), this, SIGNAL(disconnected(int)), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
 
     QkProtocol *protocol = m_qk->protocol();
     QkProtocolWorker *protocolWorker = protocol->worker();
 
     connect(protocolWorker, SIGNAL(frameReady(QkFrame)), m_worker, SLOT(sendFrame(QkFrame)), Qt::DirectConnection);
-    connect(m_worker, SIGNAL(frameReady(QkFrame)), protocolWorker, SLOT(parseFrame(QkFrame)), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(frameReady(QkFrame)), protocolWorker, SLOT(receiveFrame(QkFrame)), Qt::DirectConnection);
 }
 
 
@@ -28,42 +28,21 @@ class QkConnSerialWorker : public QkConnWorker
 {
     Q_OBJECT
 public:
-    class Protocol
-    {
-    public:
-        enum ControlFlag
-        {
-            cfTramsmiting = MASK(1, 0),
-            cfReceiving = MASK(1, 1),
-            cfFrameReady = MASK(1, 2),
-            cfDataLinkEscape = MASK(1, 3),
-            cfValid = MASK(1, 4)
-        };
-
-        Protocol()
-        {
-            frame.clear();
-            ctrlFlags = 0;
-            bytesRead = 0;
-        }
-
-        QByteArray frame;
-        int ctrlFlags;
-        int bytesRead;
-    };
-
     QkConnSerialWorker(QkConnSerial *conn);
     void run();
     void setBootPol(bool state);
+    int descriptor();
 
 public slots:
     void slotReadyRead();
 
-private:
-    void parseSerialData(quint8 data);
+protected:
+    bool openDevice();
+    void closeDevice();
+    QIODevice* device() { return m_sp; }
 
+private:
     QSerialPort *m_sp;
-    Protocol *m_protocol;
     bool m_bootPol;
 };
 
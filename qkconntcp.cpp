@@ -0,0 +1,200 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkconntcp.h"
+#include "qkcore.h"
+#include "qkprotocol.h"
+#include "qkconnect.h"
+
+#include <QDebug>
+#include <QEventLoop>
+#include <QTcpSocket>
+
+
+QkConnTcpWorker::QkConnTcpWorker(QkConnTcp *conn) :
+    QkConnWorker(conn)
+{
+    m_socket = 0;
+}
+
+int QkConnTcpWorker::descriptor()
+{
+    if(m_socket != 0)
+        return (int) m_socket->socketDescriptor();
+    return -1;
+}
+
+bool QkConnTcpWorker::openDevice()
+{
+    // No parent: in reactor mode the socket is moved to the reactor thread.
+    m_socket = new QTcpSocket();
+
+    QkConnection::Descriptor desc = connection()->descriptor();
+
+    QString host = desc.parameters.value("host").toString();
+    int port = desc.parameters.value("port").toInt();
+
+    m_socket->connectToHost(host, port);
+    if(m_socket->waitForConnected(QkConnTcp::ConnectTimeout))
+    {
+        // frames are small and latency bound, never let Nagle hold them back
+        m_socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        qDebug() << "connection opened:" << host << port;
+    }
+    else
+    {
+        emit error(tr("Failed to connect to ") + host + ":" + QString::number(port) + " " + m_socket->errorString());
+        delete m_socket;
+        m_socket = 0;
+        return false;
+    }
+    return true;
+}
+
+void QkConnTcpWorker::closeDevice()
+{
+    if(m_socket == 0)
+        return;
+
+    // On the shared reactor thread nothing may wait for the peer; frames
+    // are written straight to the descriptor there, so nothing is lost.
+    if(reactor() != 0)
+        m_socket->abort();
+    else if(m_socket->state() == QAbstractSocket::ConnectedState)
+    {
+        m_socket->disconnectFromHost();
+        if(m_socket->state() != QAbstractSocket::UnconnectedState)
+            m_socket->waitForDisconnected(1000);
+    }
+    delete m_socket;
+    m_socket = 0;
+}
+
+void QkConnTcpWorker::run()
+{
+    QEventLoop eventLoop;
+
+    m_protocol = Protocol();
+    if(!openDevice())
+    {
+        emit finished();
+        return;
+    }
+
+    connect(m_socket, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+    connect(m_socket, SIGNAL(disconnected()), this, SLOT(slotDisconnected()));
+
+    m_connected = true;
+    emit connected(connection()->id());
+
+    while(!m_quit)
+    {
+        // Sleep until the socket has data, a frame is queued or quit() is called.
+        eventLoop.processEvents(QEventLoop::WaitForMoreEvents);
+
+        if(encodePending() == 0)
+            continue;
+
+        m_socket->write(m_txBuffer);
+
+#ifdef QK_DEBUG_FRAMES
+        qDebug() << "tx: " << m_txBuffer.toHex();
+#endif
+    }
+
+    closeDevice();
+    m_connected = false;
+
+    emit disconnected(connection()->id());
+    emit finished();
+
+    eventLoop.processEvents();
+}
+
+void QkConnTcpWorker::slotReadyRead()
+{
+    qint64 count;
+
+    // Read straight into the reusable buffer and deframe in place.
+    while(m_socket->bytesAvailable() > 0)
+    {
+        count = m_socket->read(m_rxBuffer.data(), m_rxBuffer.size());
+        if(count <= 0)
+            break;
+
+#ifdef QK_DEBUG_FRAMES
+        qDebug() << "rx: " << QByteArray::fromRawData(m_rxBuffer.constData(), count).toHex();
+#endif
+        parseData(m_rxBuffer.constData(), (int) count);
+    }
+}
+
+void QkConnTcpWorker::slotDisconnected()
+{
+    if(!m_quit)
+    {
+        emit error(tr("Connection closed by ") + m_socket->peerName());
+        quit(); // also wakes the loop out of processEvents()
+    }
+}
+
+QkConnTcp::QkConnTcp(const QString &host, int port, QObject *parent) :
+    QkConnection(parent)
+{
+    m_descriptor.type = QkConnection::tTCP;
+    m_descriptor.parameters["host"] = host;
+    m_descriptor.parameters["port"] = port;
+
+    m_workerThread = new QThread(this);
+    m_worker = new QkConnTcpWorker(this);
+    m_worker->moveToThread(m_workerThread);
+
+    connect(m_workerThread, SIGNAL(started()), m_worker, SLOT(start()), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(finished()), m_workerThread, SLOT(quit()), Qt::DirectConnection);
+
+    connect(m_worker, SIGNAL(connected(int)), this, SIGNAL(connected(int)), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(disconnected(int)), this, SIGNAL(disconnected(int)), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
+
+    QkProtocol *protocol = m_qk->protocol();
+    QkProtocolWorker *protocolWorker = protocol->worker();
+
+    connect(protocolWorker, SIGNAL(frameReady(QkFrame)), m_worker, SLOT(sendFrame(QkFrame)), Qt::DirectConnection);
+    connect(m_worker, SIGNAL(frameReady(QkFrame)), protocolWorker, SLOT(receiveFrame(QkFrame)), Qt::DirectConnection);
+}
+
+void QkConnTcp::setHost(const QString &host)
+{
+    m_descriptor.parameters["host"] = host;
+}
+
+void QkConnTcp::setPort(int port)
+{
+    m_descriptor.parameters["port"] = port;
+}
+
+bool QkConnTcp::sameAs(const Descriptor &desc)
+{
+    if(desc.type == QkConnection::tTCP &&
+       desc.parameters.value("host") == m_descriptor.parameters.value("host") &&
+       desc.parameters.value("port").toInt() == m_descriptor.parameters.value("port").toInt())
+        return true;
+
+    return false;
+}
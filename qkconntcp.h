@@ -0,0 +1,69 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKCONNTCP_H
+#define QKCONNTCP_H
+
+#include "qkconnect.h"
+class QTcpSocket;
+class QkConnTcp;
+
+class QkConnTcpWorker : public QkConnWorker
+{
+    Q_OBJECT
+public:
+    QkConnTcpWorker(QkConnTcp *conn);
+    void run();
+    int descriptor();
+
+public slots:
+    void slotReadyRead();
+    void slotDisconnected();
+
+protected:
+    bool openDevice();
+    void closeDevice();
+    QIODevice* device() { return m_socket; }
+
+private:
+    QTcpSocket *m_socket;
+};
+
+/**
+ * Connection to a serial-to-Ethernet bridge (or any peer speaking the
+ * FLAG/DLE framing over a TCP stream). Descriptor parameters are "host"
+ * and "port".
+ */
+class QKLIBSHARED_EXPORT QkConnTcp : public QkConnection
+{
+    Q_OBJECT
+public:
+    enum
+    {
+        ConnectTimeout = 5000 // ms
+    };
+
+    QkConnTcp(const QString &host, int port, QObject *parent = 0);
+    void setHost(const QString &host);
+    void setPort(int port);
+
+    bool sameAs(const Descriptor &desc);
+};
+
+#endif // QKCONNTCP_H
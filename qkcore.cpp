@@ -23,6 +23,8 @@
 
 #include "qknode.h"
 #include "qkprotocol.h"
+#include "qkconnect.h"
+#include "qkarchive.h"
 
 #include <QDebug>
 #include <QElapsedTimer>
@@ -42,8 +44,11 @@ QkCore::QkCore(QkConnection *conn, QObject *parent) :
 {
     qRegisterMetaType<QkFrame>("QkFrame");
     qRegisterMetaType<QkPacket>("QkPacket");
+    qRegisterMetaType<QkAck>("QkAck");
 
     m_conn = conn;
+    m_archive = 0;
+    m_archiveSource = -1;
     m_protocol = new QkProtocol(this);
     reset();
 }
@@ -53,6 +58,40 @@ QkCore::~QkCore()
     delete m_protocol;
 }
 
+void QkCore::setArchive(QkArchive *archive)
+{
+    int source = -1;
+    if(archive != 0)
+    {
+        // streams are named after the link, so two connections never mix
+        // devices that happen to share an address
+        QkConnection::Descriptor desc;
+        desc.type = QkConnection::tUnknown;
+        if(m_conn != 0)
+            desc = m_conn->descriptor();
+        QString name = QkConnection::typeToString(desc.type);
+        if(desc.type == QkConnection::tSerial)
+            name += "-" + desc.parameters.value("portName").toString();
+        else if(desc.type == QkConnection::tTCP)
+            name += "-" + desc.parameters.value("host").toString() +
+                    "-" + desc.parameters.value("port").toString();
+        source = archive->addSource(name);
+    }
+
+    m_archiveLock.lock();
+    m_archive = archive;
+    m_archiveSource = source;
+    m_archiveLock.unlock();
+}
+
+void QkCore::_archive(int address, const float *values, int count, quint64 timestamp)
+{
+    m_archiveLock.lock();
+    if(m_archive != 0)
+        m_archive->append(m_archiveSource, address, values, count, timestamp);
+    m_archiveLock.unlock();
+}
+
 void QkCore::reset()
 {
     QList<QkNode*> nodes = m_nodes.values();
@@ -85,7 +124,7 @@ bool QkCore::waitForReady(int timeout)
     QElapsedTimer elapsedTimer;
 
     connect(&timer, SIGNAL(timeout()), &eventLoop, SLOT(quit()));
-    connect(m_protocol, SIGNAL(packetProcessed()), &eventLoop, SLOT(quit()));
+    connect(m_protocol, SIGNAL(ready()), &eventLoop, SLOT(quit()));
 
     timer.start(timeout);
     elapsedTimer.restart();
@@ -135,40 +174,79 @@ int QkCore::search()
 }
 
 int QkCore::getNode(int address)
+{
+    return getNodeAsync(address)->waitForFinished().toInt();
+}
+
+int QkCore::start(int address)
+{
+    return sendRunControl(QK_PACKET_CODE_START, address);
+}
+
+int QkCore::stop(int address)
+{
+    return sendRunControl(QK_PACKET_CODE_STOP, address);
+}
+
+int QkCore::sendRunControl(int code, int address)
+{
+    // The state is updated here, before returning, rather than by the
+    // queued finished() the async variants rely on: isRunning() must agree
+    // with an OK returned by start()/stop().
+    QkPacket::Descriptor pd;
+    pd.address = address;
+    pd.code = code;
+    QkAck ack = m_protocol->sendPacketAsync(pd)->waitForFinished();
+    slotRequestFinished(ack);
+    return ack.toInt();
+}
+
+QkRequestPtr QkCore::getNodeAsync(int address)
 {
     QkPacket::Descriptor pd;
     pd.address = address;
     pd.code = QK_PACKET_CODE_GETNODE;
     pd.getnode_address = address;
-    return m_protocol->sendPacket(pd).toInt();
+    return m_protocol->sendPacketAsync(pd);
 }
 
-int QkCore::start(int address)
+QkRequestPtr QkCore::startAsync(int address)
 {
     QkPacket::Descriptor pd;
     pd.address = address;
     pd.code = QK_PACKET_CODE_START;
-    QkAck ack = m_protocol->sendPacket(pd);
-    if(ack.result == QkAck::ACK_OK) {
-        m_running = true;
-        emit status(sStarted);
-    }
-    return ack.toInt();
+    QkRequestPtr request = m_protocol->sendPacketAsync(pd);
+    connect(request.data(), SIGNAL(finished(QkAck)), this, SLOT(slotRequestFinished(QkAck)));
+    return request;
 }
 
-
-int QkCore::stop(int address)
+QkRequestPtr QkCore::stopAsync(int address)
 {
     QkPacket::Descriptor pd;
     pd.address = address;
     pd.code = QK_PACKET_CODE_STOP;
-    QkAck ack = m_protocol->sendPacket(pd);
-    if(ack.result == QkAck::ACK_OK)
+    QkRequestPtr request = m_protocol->sendPacketAsync(pd);
+    connect(request.data(), SIGNAL(finished(QkAck)), this, SLOT(slotRequestFinished(QkAck)));
+    return request;
+}
+
+void QkCore::slotRequestFinished(QkAck ack)
+{
+    if(ack.result != QkAck::ACK_OK)
+        return;
+
+    switch(ack.code)
     {
+    case QK_PACKET_CODE_START:
+        m_running = true;
+        emit status(sStarted);
+        break;
+    case QK_PACKET_CODE_STOP:
         m_running = false;
         emit status(sStopped);
+        break;
+    default: ;
     }
-    return ack.toInt();
 }
 
 void QkCore::slotStatus(QkCore::Status status)
@@ -41,6 +41,7 @@ class QkDevice;
 class QkComm;
 class QkPacket;
 class QkConnection;
+class QkArchive;
 
 typedef QMap<int, QkNode*> QkNodeMap;
 
@@ -73,6 +74,14 @@ public:
     QkNodeMap nodes();
     QkConnection *connection() { return m_conn; }
     QkProtocol* protocol() { return m_protocol; }
+    // The archive is not owned. Detach it with setArchive(0) before
+    // deleting it: that returns once the protocol thread is done with it.
+    void setArchive(QkArchive *archive);
+    QkArchive* archive() { return m_archive; }
+    int archiveSource() { return m_archiveSource; }
+    void _archive(int address, const float *values, int count, quint64 timestamp);
+
+    void _setReady(bool ready) { m_ready = ready; }
 
 
 signals:
@@ -85,8 +94,17 @@ public slots:
     int start(int address = 0);
     int stop(int address = 0);
 
+public:
+    QkRequestPtr getNodeAsync(int address = 0);
+    QkRequestPtr startAsync(int address = 0);
+    QkRequestPtr stopAsync(int address = 0);
+
+private slots:
+    void slotRequestFinished(QkAck ack);
+
 private:
     void slotStatus(QkCore::Status status);
+    int sendRunControl(int code, int address);
 
 private:
     bool m_ready;
@@ -94,6 +112,9 @@ private:
     QMap<int, QkNode*> m_nodes;
     QkProtocol *m_protocol;
     QkConnection *m_conn;
+    QkArchive *m_archive;
+    int m_archiveSource;
+    QkSpinLock m_archiveLock; // held by the protocol thread while appending
 
 
 };
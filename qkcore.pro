@@ -7,12 +7,15 @@
 QT       -= gui
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += serialport
+QT       += network
 
 TARGET = qkcore
 TEMPLATE = lib
+CONFIG += c++11
 INCLUDEPATH += ../utils
 
 #DEFINES += QT_NO_DEBUG_OUTPUT
+#DEFINES += QK_DEBUG_FRAMES
 
 DEFINES += QKLIB_LIBRARY
 
@@ -25,7 +28,16 @@ SOURCES += \
     qknode.cpp \
     qkprotocol.cpp \
     qkconnect.cpp \
-    qkconnserial.cpp
+    qkconnserial.cpp \
+    qkconntcp.cpp \
+    qktimerwheel.cpp \
+    qkpackethandler.cpp \
+    qkcodec.cpp \
+    qksamplelog.cpp \
+    qkarchive.cpp \
+    qkaggregator.cpp \
+    qksubscription.cpp \
+    qkreactor.cpp
 
 HEADERS +=\
     qkcore.h \
@@ -38,7 +50,18 @@ HEADERS +=\
     qkcore_lib.h \
     qkcore_constants.h \
     qkconnserial.h \
-    qkconnect.h
+    qkconntcp.h \
+    qkconnect.h \
+    qktimerwheel.h \
+    qkpackethandler.h \
+    qkcodec.h \
+    qksamplelog.h \
+    qkarchive.h \
+    qkaggregator.h \
+    qkseqlock.h \
+    qksubscription.h \
+    qkreactor.h \
+    qkring.h
 
 unix:!symbian {
     maemo5 {
@@ -23,6 +23,8 @@
 #include <QDebug>
 #include <QMetaEnum>
 
+#include <string.h>
+
 QkDevice::QkDevice(QkCore *qk, QkNode *parentNode) :
     QkBoard(qk)
 {
@@ -32,8 +34,13 @@ QkDevice::QkDevice(QkCore *qk, QkNode *parentNode) :
     m_parentNode = parentNode;
     m_type = btDevice;
     m_events.clear();
-    m_data.clear();
+    m_dataLabels.clear();
     m_actions.clear();
+    m_valueCount = 0;
+    m_valuesTimestamp = 0;
+    m_dataType = Data::dtFloat;
+    m_history = HistoryPtr(new History);
+    m_dataLogCapacity.store(m_history->log.capacity());
 }
 
 QString QkDevice::samplingModeString(SamplingMode mode)
@@ -80,7 +87,17 @@ void QkDevice::_setSamplingInfo(SamplingInfo info)
 
 void QkDevice::_setData(QVector<Data> data)
 {
-    m_data = data;
+    QStringList labels;
+    labels.reserve(data.count());
+    for(int i = 0; i < data.count(); i++)
+        labels.append(data[i].label());
+
+    m_metaLock.lock();
+    m_dataLabels = labels;
+    m_metaLock.unlock();
+
+    if(data.count() != m_history->log.channels())
+        relayout(data.count());
 }
 
 void QkDevice::_setDataType(Data::Type type)
@@ -90,46 +107,132 @@ void QkDevice::_setDataType(Data::Type type)
 
 void QkDevice::_setDataValue(int idx, float value, quint64 timestamp)
 {
-    if(idx < 0 || idx > m_data.size())
+    if(idx < 0 || idx >= MaxChannels)
     {
         qWarning() << __FUNCTION__ << "data index out of bounds";
-        m_data.resize(idx+1);
+        return;
     }
-    m_data[idx]._setValue(value, timestamp);
+    m_valuesLock.beginWrite();
+    m_values[idx] = value;
+    m_intValues[idx] = (qint32) value;
+    m_valuesTimestamp = timestamp;
+    if(m_valueCount <= idx)
+        m_valueCount = idx + 1;
+    m_valuesLock.endWrite();
+}
+
+void QkDevice::_setDataValues(const float *values, int count, quint64 timestamp, const qint32 *ints)
+{
+    count = qMin(count, (int) MaxChannels);
+
+    m_valuesLock.beginWrite();
+    memcpy(m_values, values, count * sizeof(float));
+    if(ints != 0)
+        memcpy(m_intValues, ints, count * sizeof(qint32));
+    m_valuesTimestamp = timestamp;
+    m_valueCount = count;
+    m_valuesLock.endWrite();
 }
 
 void QkDevice::_setDataLabel(int idx, const QString &label)
 {
-    m_data[idx]._setLabel(label);
+    m_metaLock.lock();
+    if(idx >= 0 && idx < m_dataLabels.count())
+        m_dataLabels[idx] = label;
+    m_metaLock.unlock();
+}
+
+// Decoder thread: builds the history for the new layout and publishes it.
+QkDevice::History* QkDevice::relayout(int channels)
+{
+    HistoryPtr history(new History);
+    history->log.setCapacity(m_dataLogCapacity.load());
+    history->log.setChannels(channels);
+    history->aggregator.setChannels(channels);
+
+    m_historyLock.lock();
+    m_history.swap(history);
+    m_historyLock.unlock();
+    return m_history.data();
+}
+
+// Any thread: a reference that stays valid across a relayout.
+QkDevice::HistoryPtr QkDevice::history()
+{
+    m_historyLock.lock();
+    HistoryPtr history = m_history;
+    m_historyLock.unlock();
+    return history;
+}
+
+void QkDevice::_logData(const float *values, int count, quint64 timestamp)
+{
+    // only this thread replaces m_history, so it is read here unlocked
+    History *history = m_history.data();
+    if(count != history->log.channels() || m_dataLogCapacity.load() != history->log.capacity())
+        history = relayout(count);
+
+    history->log.append(values, timestamp);
+    history->aggregatorLock.beginWrite();
+    history->aggregator.add(values, count, timestamp);
+    history->aggregatorLock.endWrite();
+
+    m_qk->_archive(address(), values, count, timestamp);
+}
+
+// The decoder reallocates (and clears) the log when the next sample arrives.
+void QkDevice::setDataLogCapacity(int capacity)
+{
+    if(capacity > 0)
+        m_dataLogCapacity.store(capacity);
 }
 
-void QkDevice::_logData(const DataArray &data)
+// values holds samples x count floats, sample by sample. The first sample
+// is taken at timestamp (ms) and the next ones every interval microseconds.
+void QkDevice::_logSamples(const float *values, int count, int samples, quint64 timestamp, int interval,
+                           const qint32 *lastInts)
 {
-    m_dataLog.append(data);
-    while(m_dataLog.count() > _dataLogMax)
-        m_dataLog.removeFirst();
+    if(samples <= 0)
+        return;
+    quint64 sampleTimestamp = timestamp;
+    for(int k = 0; k < samples; k++)
+    {
+        sampleTimestamp = timestamp + ((qint64) k * interval) / 1000;
+        _logData(values + k*count, count, sampleTimestamp);
+    }
+    _setDataValues(values + (samples-1)*count, count, sampleTimestamp, lastInts);
 }
 
 void QkDevice::_setActions(ActionArray actions)
 {
+    m_metaLock.lock();
     m_actions = actions;
+    m_metaLock.unlock();
 }
 
 void QkDevice::_setEvents(QVector<Event> events)
 {
+    m_metaLock.lock();
     m_events = events;
+    m_metaLock.unlock();
 }
 
 void QkDevice::_logEvent(const QkDevice::Event &event)
 {
+    m_eventLock.lock();
     m_eventLog.append(event);
     while(m_eventLog.count() > _eventLogMax)
         m_eventLog.removeFirst();
+    m_eventLock.unlock();
 }
 
+// Shares the log (no deep copy); the writer detaches on its next append.
 QQueue<QkDevice::Event> QkDevice::eventLog()
 {
-    return m_eventLog;
+    m_eventLock.lock();
+    EventLog log = m_eventLog;
+    m_eventLock.unlock();
+    return log;
 }
 
 QkDevice::SamplingInfo QkDevice::samplingInfo()
@@ -142,43 +245,199 @@ QkDevice::Data::Type QkDevice::dataType()
     return m_dataType;
 }
 
+int QkDevice::dataCount()
+{
+    m_metaLock.lock();
+    int count = m_dataLabels.count();
+    m_metaLock.unlock();
+    return count;
+}
+
+QStringList QkDevice::dataLabels()
+{
+    m_metaLock.lock();
+    QStringList labels = m_dataLabels;
+    m_metaLock.unlock();
+    return labels;
+}
+
+// Builds the labelled copy; prefer dataView() or readDataValues() per sample.
 QVector<QkDevice::Data> QkDevice::data()
 {
-    return m_data;
+    float values[MaxChannels];
+    quint64 timestamp;
+    int count = readDataValues(values, MaxChannels, &timestamp);
+    QStringList labels = dataLabels();
+
+    DataArray data(labels.count());
+    for(int i = 0; i < data.count(); i++)
+    {
+        data[i]._setLabel(labels[i]);
+        if(i < count)
+            data[i]._setValue(values[i], timestamp);
+    }
+    return data;
+}
+
+QkDevice::DataView QkDevice::dataView() const
+{
+    return DataView(m_values, m_intValues, m_valueCount, m_valuesTimestamp, m_dataType);
+}
+
+// Copies the latest value of up to max channels without ever blocking the
+// decoder; returns the number of channels copied.
+int QkDevice::readDataValues(float *values, int max, quint64 *timestamp)
+{
+    int sequence, count;
+    do
+    {
+        sequence = m_valuesLock.readBegin();
+        count = qMin(m_valueCount, max);
+        memcpy(values, m_values, count * sizeof(float));
+        if(timestamp != 0)
+            *timestamp = m_valuesTimestamp;
+    } while(m_valuesLock.readRetry(sequence));
+    return count;
+}
+
+int QkDevice::readDataInts(qint32 *values, int max, quint64 *timestamp)
+{
+    const bool integer = (m_dataType == Data::dtInt);
+    int sequence, count;
+    do
+    {
+        sequence = m_valuesLock.readBegin();
+        count = qMin(m_valueCount, max);
+        if(integer)
+            memcpy(values, m_intValues, count * sizeof(qint32));
+        else
+        {
+            for(int i = 0; i < count; i++)
+                values[i] = (qint32) m_values[i];
+        }
+        if(timestamp != 0)
+            *timestamp = m_valuesTimestamp;
+    } while(m_valuesLock.readRetry(sequence));
+    return count;
+}
+
+QVector<float> QkDevice::dataValues()
+{
+    QVector<float> values(MaxChannels);
+    values.resize(readDataValues(values.data(), MaxChannels));
+    return values;
+}
+
+int QkDevice::dataLogSnapshot(int channel, int last, float *values, quint64 *timestamps)
+{
+    HistoryPtr history = this->history();
+    return history->log.snapshot(channel, last, values, timestamps);
+}
+
+// A copy of the newest _dataLogMax samples, oldest first, safe from any
+// thread. Prefer dataLogSnapshot() for more history or per channel.
+QkDevice::DataLog QkDevice::dataLog()
+{
+    const QStringList labels = dataLabels();
+    QVector<float> values;
+    QVector<quint64> timestamps(_dataLogMax);
+    HistoryPtr history = this->history();
+    const int channels = history->log.channels();
+    values.resize(channels * _dataLogMax);
+    const int count = history->log.snapshot(_dataLogMax, values.data(), timestamps.data());
+
+    DataLog log;
+    for(int s = 0; s < count; s++)
+    {
+        DataArray sample(channels);
+        for(int c = 0; c < channels; c++)
+        {
+            if(c < labels.count())
+                sample[c]._setLabel(labels.at(c));
+            sample[c]._setValue(values.at(c*_dataLogMax + s), timestamps.at(s));
+        }
+        log.enqueue(sample);
+    }
+    return log;
+}
+
+QkAggregator::Rollup QkDevice::dataWindow(int channel, int ms)
+{
+    HistoryPtr history = this->history();
+    QkAggregator::Rollup rollup;
+    int sequence;
+    do
+    {
+        sequence = history->aggregatorLock.readBegin();
+        rollup = history->aggregator.window(channel, ms);
+    } while(history->aggregatorLock.readRetry(sequence));
+    return rollup;
+}
+
+int QkDevice::dataRollups(int channel, int level, quint64 from, quint64 to, QVector<QkAggregator::Rollup> *rollups)
+{
+    HistoryPtr history = this->history();
+    const int base = rollups->count();
+    int sequence, count;
+    do
+    {
+        rollups->resize(base);
+        sequence = history->aggregatorLock.readBegin();
+        count = history->aggregator.rollups(channel, level, from, to, rollups);
+    } while(history->aggregatorLock.readRetry(sequence));
+    return count;
 }
 
 QkDevice::ActionArray QkDevice::actions()
 {
-    return m_actions;
+    m_metaLock.lock();
+    ActionArray actions = m_actions;
+    m_metaLock.unlock();
+    return actions;
 }
 
 QVector<QkDevice::Event> QkDevice::events()
 {
-    return m_events;
+    m_metaLock.lock();
+    EventArray events = m_events;
+    m_metaLock.unlock();
+    return events;
 }
 
 int QkDevice::actuate(int id, QVariant value)
 {
     qDebug() << __FUNCTION__;
-    if(id >= m_actions.count())
+    QkRequestPtr request = actuateAsync(id, value);
+    if(request.isNull())
         return -1;
 
-    m_actions[id]._setValue(value);
+    QkAck ack = request->waitForFinished();
+    if(ack.result != QkAck::ACK_OK)
+        return -2;
+
+    return 0;
+}
+
+QkRequestPtr QkDevice::actuateAsync(int id, QVariant value)
+{
+    m_metaLock.lock();
+    bool valid = (id >= 0 && id < m_actions.count());
+    if(valid)
+        m_actions[id]._setValue(value);
+    m_metaLock.unlock();
+    if(!valid)
+        return QkRequestPtr();
 
-    QkPacket packet;
     QkPacket::Descriptor desc;
 
     desc.boardType = m_type;
     desc.board = this;
+    desc.address = address();
 
     desc.code = QK_PACKET_CODE_ACTUATE;
     desc.action_id = id;
 
-    QkAck ack = m_qk->protocol()->sendPacket(desc);
-    if(ack.result != QkAck::ACK_OK)
-        return -2;
-
-    return 0;
+    return m_qk->protocol()->sendPacketAsync(desc);
 }
 
 QkDevice::Data::Data()
@@ -23,8 +23,15 @@
 #include <QObject>
 #include <QVector>
 #include <QQueue>
+#include <QStringList>
 #include <QVariant>
 #include "qkboard.h"
+#include "qksamplelog.h"
+#include "qkaggregator.h"
+#include "qkseqlock.h"
+
+#include <QSharedPointer>
+#include <QAtomicInt>
 
 class QKLIBSHARED_EXPORT QkDevice : public QkBoard
 {
@@ -125,8 +132,39 @@ public:
         QVariant m_value;
     };
 
+    // Latest values of every data channel, without the labels. It points
+    // into the device, so it is only valid on the protocol thread (e.g. in a
+    // slot directly connected to QkProtocol::dataUpdated()); other threads
+    // copy the values out with readDataValues() or readDataInts().
+    class DataView
+    {
+    public:
+        DataView(const float *values = 0, const qint32 *ints = 0, int count = 0,
+                 quint64 timestamp = 0, Data::Type type = Data::dtFloat) :
+            m_values(values), m_ints(ints), m_count(count),
+            m_timestamp(timestamp), m_type(type) {}
+
+        int count() const { return m_count; }
+        quint64 timestamp() const { return m_timestamp; }
+        Data::Type type() const { return m_type; }
+        const float* values() const { return m_values; }
+        float value(int idx) const { return m_values[idx]; }
+        qint32 intValue(int idx) const
+        {
+            return m_type == Data::dtInt ? m_ints[idx] : (qint32) m_values[idx];
+        }
+
+    private:
+        const float *m_values;
+        const qint32 *m_ints;
+        int m_count;
+        quint64 m_timestamp;
+        Data::Type m_type;
+    };
+
     typedef QVector<Data> DataArray;
     typedef QQueue<DataArray> DataLog;
+    typedef QkSampleLog SampleLog;
     typedef QVector<Event> EventArray;
     typedef QQueue<Event> EventLog;
     typedef QVector<Action> ActionArray;
@@ -145,22 +183,39 @@ public:
     void _setData(DataArray data);
     void _setDataType(Data::Type type);
     void _setDataValue(int idx, float value, quint64 timestamp = 0);
+    void _setDataValues(const float *values, int count, quint64 timestamp = 0, const qint32 *ints = 0);
     void _setDataLabel(int idx, const QString &label);
-    void _logData(const DataArray &data);
+    void _logData(const float *values, int count, quint64 timestamp);
+    void _logSamples(const float *values, int count, int samples, quint64 timestamp, int interval,
+                     const qint32 *lastInts = 0);
     void _setActions(ActionArray actions);
     void _setEvents(EventArray events);
     void _logEvent(const Event &event);
 
-    QQueue<QkDevice::Data> dataLog();
+    DataLog dataLog();
+    int dataLogSnapshot(int channel, int last, float *values, quint64 *timestamps = 0);
+    // the live columnar log; only valid on the protocol (decoder) thread
+    const SampleLog& decoderThreadSampleLog() { return m_history->log; }
+    void setDataLogCapacity(int capacity);
+    int dataLogCapacity() { return m_dataLogCapacity.load(); }
+    QkAggregator::Rollup dataWindow(int channel, int ms);
+    int dataRollups(int channel, int level, quint64 from, quint64 to, QVector<QkAggregator::Rollup> *rollups);
     QQueue<QkDevice::Event> eventLog();
 
     SamplingInfo samplingInfo();
     Data::Type dataType();
     DataArray data();
+    int dataCount();
+    QStringList dataLabels();
+    DataView dataView() const;
+    QVector<float> dataValues();
+    int readDataValues(float *values, int max, quint64 *timestamp = 0);
+    int readDataInts(qint32 *values, int max, quint64 *timestamp = 0);
     ActionArray actions();
     EventArray events();
 
     int actuate(int id, QVariant value);
+    QkRequestPtr actuateAsync(int id, QVariant value);
 
 protected:
     void setup();
@@ -168,17 +223,46 @@ protected:
 private:
     enum
     {
-        _dataLogMax = 128,
-        _eventLogMax = 128
+        _eventLogMax = 128,
+        _dataLogMax = 128, // samples returned by dataLog()
+        MaxChannels = 256
+    };
+    // Sample history. The decoder appends to m_history without locking and
+    // is the only thread that replaces it: a new layout (channel count or
+    // capacity) is built into a fresh History and swapped in. Readers keep
+    // the one they took a reference to.
+    class History
+    {
+    public:
+        SampleLog log;
+        QkAggregator aggregator;
+        QkSeqLock aggregatorLock;
     };
+    typedef QSharedPointer<History> HistoryPtr;
+
+    HistoryPtr history();
+    History* relayout(int channels);
+
     SamplingInfo m_samplingInfo;
-    DataArray m_data;
+    QStringList m_dataLabels;
     ActionArray m_actions;
     EventArray m_events;
     Data::Type m_dataType;
+    QkSpinLock m_metaLock;
+
+    // latest values, written by the decoder and read through m_valuesLock
+    float m_values[MaxChannels];
+    qint32 m_intValues[MaxChannels]; // exact wire values of dtInt channels
+    quint64 m_valuesTimestamp;
+    int m_valueCount;
+    QkSeqLock m_valuesLock;
+
+    HistoryPtr m_history;
+    QkSpinLock m_historyLock; // guards the m_history pointer, not its contents
+    QAtomicInt m_dataLogCapacity; // applied by the decoder on its next sample
 
-    DataLog m_dataLog;
     EventLog m_eventLog;
+    QkSpinLock m_eventLock;
 
 };
 
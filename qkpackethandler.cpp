@@ -0,0 +1,576 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkpackethandler.h"
+#include "qkprotocol.h"
+#include "qkcore.h"
+#include "qkboard.h"
+#include "qkdevice.h"
+
+#include "qkutils.h"
+#include "qkcore_constants.h"
+
+#include <QDebug>
+#include <QDateTime>
+#include <QStringList>
+
+using namespace QkUtils;
+
+class QkAckHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        // Only discovery ACKs get here (see QkProtocol::processAck), after
+        // the worker has completed their request and emitted ack().
+        QkAck ack;
+        if(!ack.decode(packet))
+            return;
+
+        if(protocol->board(packet) == 0)
+            return;
+
+        if(ack.code == QK_PACKET_CODE_SEARCH)
+        {
+            switch(packet.source())
+            {
+            case QkBoard::btComm: emit protocol->commFound(packet.address); break;
+            case QkBoard::btDevice: emit protocol->deviceFound(packet.address); break;
+            }
+        }
+        else if((ack.code == QK_PACKET_CODE_GETNODE && packet.source() == QkBoard::btComm) ||
+                ack.code == QK_PACKET_CODE_GETMODULE)
+        {
+            emit protocol->commUpdated(packet.address);
+        }
+        else if((ack.code == QK_PACKET_CODE_GETNODE && packet.source() == QkBoard::btDevice) ||
+                ack.code == QK_PACKET_CODE_GETDEVICE)
+        {
+            emit protocol->deviceUpdated(packet.address);
+        }
+    }
+};
+
+class QkReadyHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        Q_UNUSED(packet);
+        protocol->qk()->_setReady(true);
+        emit protocol->ready();
+    }
+};
+
+class QkInfoQkHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkBoard *board = protocol->board(packet);
+        if(board == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int major, minor, patch;
+        QkInfo qkInfo;
+        if(!packet.read<QkPacket::InfoQkLayout>(&i_data, &major, &minor, &patch,
+                                                &qkInfo.baudRate, &qkInfo.flags))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOQK";
+            return;
+        }
+        qkInfo.version = Version(major, minor, patch);
+        board->_setQkInfo(qkInfo);
+        board->_setInfoMask((int)QkBoard::biQk);
+    }
+};
+
+class QkInfoBoardHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkBoard *board = protocol->board(packet);
+        if(board == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int fwVersion;
+        QString name;
+        if(!packet.read<QkPacket::InfoBoardLayout>(&i_data, &fwVersion, &name))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOBOARD";
+            return;
+        }
+        board->_setFirmwareVersion(fwVersion);
+        board->_setName(name);
+        board->_setInfoMask((int)QkBoard::biBoard);
+    }
+};
+
+class QkInfoConfigHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkBoard *board = protocol->board(packet);
+        if(board == 0)
+            return;
+
+        int i, j, size, type, value = 0;
+        int year = 0, month = 0, day = 0, hours = 0, minutes = 0, seconds = 0;
+        int min, max;
+        float floatValue = 0.0f;
+        QString label, item;
+        QVariant varValue;
+        QStringList items;
+        QDateTime dateTime;
+        bool ok;
+
+        int i_data = packet.dataOffset;
+        int ncfg;
+        if(!packet.read<QkPacket::CountLayout>(&i_data, &ncfg))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOCONFIG";
+            return;
+        }
+        QkBoard::ConfigArray configs(ncfg);
+        for(i=0; i<ncfg; i++)
+        {
+            min = 0;
+            max = 0;
+            ok = packet.read<QkPacket::TypedLabelLayout>(&i_data, &type, &label);
+            QkBoard::Config::Type configType = (QkBoard::Config::Type) type;
+            switch(configType)
+            {
+            case QkBoard::Config::ctBool:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::UInt<1>>>(&i_data, &value);
+                varValue = QVariant((bool) value);
+                break;
+            case QkBoard::Config::ctIntDec:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::SInt<4>>>(&i_data, &value)
+                        && packet.read<QkPacket::RangeLayout>(&i_data, &min, &max);
+                varValue = QVariant(value);
+                break;
+            case QkBoard::Config::ctIntHex:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::SInt<4>>>(&i_data, &value)
+                        && packet.read<QkPacket::RangeLayout>(&i_data, &min, &max);
+                varValue = QVariant((unsigned int) value);
+                break;
+            case QkBoard::Config::ctFloat:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::Float>>(&i_data, &floatValue)
+                        && packet.read<QkPacket::RangeLayout>(&i_data, &min, &max);
+                varValue = QVariant(floatValue);
+                break;
+            case QkBoard::Config::ctDateTime:
+                ok = ok && packet.read<QkPacket::DateTimeLayout>(&i_data, &year, &month, &day,
+                                                                 &hours, &minutes, &seconds);
+                dateTime = QDateTime(QDate(2000+year,month,day),QTime(hours,minutes,seconds));
+                varValue = QVariant(dateTime);
+                break;
+            case QkBoard::Config::ctTime:
+                ok = ok && packet.read<QkPacket::TimeLayout>(&i_data, &hours, &minutes, &seconds);
+                dateTime = QDateTime(QDate::currentDate(),QTime(hours,minutes,seconds));
+                varValue = QVariant(dateTime);
+                break;
+            case QkBoard::Config::ctCombo:
+                ok = ok && packet.read<QkPacket::CountLayout>(&i_data, &size);
+                items.clear();
+                for(j=0; ok && j<size; j++)
+                {
+                    ok = packet.readString(&i_data, &item);
+                    items.append(item);
+                }
+                varValue = QVariant(items);
+                break;
+            }
+            if(!ok)
+            {
+                qWarning() << __FUNCTION__ << "truncated INFOCONFIG";
+                return;
+            }
+            configs[i]._set(label, configType, varValue, (double) min, (double) max);
+        }
+        board->_setConfigs(configs);
+        board->_setInfoMask((int)QkBoard::biConfig);
+    }
+};
+
+class QkInfoSampHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int mode, triggerClock;
+        QkDevice::SamplingInfo sampInfo;
+        if(!packet.read<QkPacket::SampLayout>(&i_data, &sampInfo.frequency, &mode, &triggerClock,
+                                              &sampInfo.triggerScaler, &sampInfo.N))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOSAMP";
+            return;
+        }
+        sampInfo.mode = (QkDevice::SamplingMode) mode;
+        sampInfo.triggerClock = (QkDevice::TriggerClock) triggerClock;
+        device->_setSamplingInfo(sampInfo);
+        device->_setInfoMask((int)QkDevice::diSampling);
+    }
+};
+
+class QkInfoDataHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int ndat, type;
+        QString label;
+        if(!packet.read<QkPacket::DataLayout>(&i_data, &ndat, &type))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFODATA";
+            return;
+        }
+        QkDevice::DataArray data(ndat);
+        for(int i=0; i<ndat; i++)
+        {
+            if(!packet.read<QkPacket::LabelLayout>(&i_data, &label))
+            {
+                qWarning() << __FUNCTION__ << "truncated INFODATA";
+                return;
+            }
+            data[i]._setLabel(label);
+        }
+        device->_setDataType((QkDevice::Data::Type) type);
+        device->_setData(data);
+        device->_setInfoMask((int)QkDevice::diData);
+    }
+};
+
+class QkInfoEventHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int nevt;
+        QString label;
+        if(!packet.read<QkPacket::CountLayout>(&i_data, &nevt))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOEVENT";
+            return;
+        }
+        QkDevice::EventArray events(nevt);
+        for(int i=0; i<nevt; i++)
+        {
+            if(!packet.read<QkPacket::LabelLayout>(&i_data, &label))
+            {
+                qWarning() << __FUNCTION__ << "truncated INFOEVENT";
+                return;
+            }
+            events[i]._setLabel(label);
+        }
+        device->_setEvents(events);
+        device->_setInfoMask((int)QkDevice::diEvent);
+    }
+};
+
+class QkInfoActionHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int nact, type, value = 0;
+        QString label;
+        if(!packet.read<QkPacket::CountLayout>(&i_data, &nact))
+        {
+            qWarning() << __FUNCTION__ << "truncated INFOACTION";
+            return;
+        }
+        QkDevice::ActionArray actions(nact);
+        for(int i = 0; i < nact; i++)
+        {
+            bool ok = packet.read<QkPacket::TypedLabelLayout>(&i_data, &type, &label);
+            actions[i]._setType((QkDevice::Action::Type) type);
+            actions[i]._setLabel(label);
+            switch(actions[i].type())
+            {
+            case QkDevice::Action::atBool:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::UInt<1>>>(&i_data, &value);
+                actions[i]._setValue(QVariant((bool) value));
+                break;
+            case QkDevice::Action::atInt:
+                ok = ok && packet.read<QkCodec::Layout<QkCodec::UInt<4>>>(&i_data, &value);
+                actions[i]._setValue(QVariant(value));
+                break;
+            }
+            if(!ok)
+            {
+                qWarning() << __FUNCTION__ << "truncated INFOACTION";
+                return;
+            }
+        }
+        device->_setActions(actions);
+        device->_setInfoMask((int)QkDevice::diAction);
+    }
+};
+
+class QkDataHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i_data = packet.dataOffset;
+        int ndat, type;
+        if(!packet.read<QkPacket::DataLayout>(&i_data, &ndat, &type) ||
+           packet.dataOffset + packet.dataLength - i_data < 4*ndat)
+        {
+            qWarning() << __FUNCTION__ << "truncated DATA";
+            return;
+        }
+        QkDevice::Data::Type dataType = (QkDevice::Data::Type) type;
+
+        bool bufferJustCreated = false;
+        if(device->dataCount() != ndat)
+        {
+            qWarning() << __FUNCTION__ << "data count doesn't match buffer size";
+            device->_setData(QkDevice::DataArray(ndat));
+            device->_setDataType(dataType);
+            bufferJustCreated = true;
+        }
+
+        if(m_values.size() < ndat)
+            m_values.resize(ndat);
+        const bool integer = (dataType == QkDevice::Data::dtInt);
+        QkCodec::decodeSamples(packet.buffer.constData() + i_data, ndat, integer, m_values.data());
+        if(integer)
+        {
+            if(m_ints.size() < ndat)
+                m_ints.resize(ndat);
+            QkCodec::decodeInts(packet.buffer.constData() + i_data, ndat, m_ints.data());
+        }
+        device->_setDataValues(m_values.constData(), ndat, packet.timestamp,
+                               integer ? m_ints.constData() : 0);
+
+        if(bufferJustCreated)
+        {
+            for(int i=0; i<ndat; i++)
+                device->_setDataLabel(i, QString().sprintf("D%d",i));
+        }
+        device->_logData(m_values.constData(), ndat, packet.timestamp);
+        protocol->_publishData(packet.address, m_values.constData(), ndat, 1, packet.timestamp);
+
+        emit protocol->dataUpdated(packet.address, packet.timestamp);
+        if(protocol->isDataReceivedConnected())
+            emit protocol->dataReceived(packet.address, device->data());
+    }
+
+private:
+    QVector<float> m_values;
+    QVector<qint32> m_ints;
+};
+
+// N consecutive samples per packet. The device clock is mapped to host time
+// once per node and kept while it agrees with the receive timestamps, so
+// batches keep the device's sample spacing instead of the link's jitter.
+class QkDataBatchHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        // 0xD3 means something else (or nothing) to older firmware: never
+        // decode it as samples unless the board announced the format.
+        if(!(device->qkInfo().flags & QK_FLAGMASK_DATABATCH))
+        {
+            qWarning() << __FUNCTION__ << "DATA_BATCH from a board without support, dropped";
+            return;
+        }
+
+        int i_data = packet.dataOffset;
+        int ndat, type, nsamp, base, interval;
+        if(!packet.read<QkPacket::DataBatchLayout>(&i_data, &ndat, &type, &nsamp, &base, &interval) ||
+           packet.dataOffset + packet.dataLength - i_data < 4*ndat*nsamp)
+        {
+            qWarning() << __FUNCTION__ << "truncated DATA_BATCH";
+            return;
+        }
+        if(ndat == 0 || nsamp == 0)
+            return;
+        QkDevice::Data::Type dataType = (QkDevice::Data::Type) type;
+        if(packet.dataOffset + packet.dataLength - i_data != 4*ndat*nsamp)
+        {
+            qWarning() << __FUNCTION__ << "DATA_BATCH length doesn't match its header, dropped";
+            return;
+        }
+
+        if(device->dataCount() != ndat)
+        {
+            qWarning() << __FUNCTION__ << "data count doesn't match buffer size";
+            device->_setData(QkDevice::DataArray(ndat));
+            device->_setDataType(dataType);
+            for(int i=0; i<ndat; i++)
+                device->_setDataLabel(i, QString().sprintf("D%d",i));
+        }
+
+        const int total = ndat*nsamp;
+        if(m_values.size() < total)
+            m_values.resize(total);
+        const bool integer = (dataType == QkDevice::Data::dtInt);
+        QkCodec::decodeSamples(packet.buffer.constData() + i_data, total, integer, m_values.data());
+        if(integer)
+        {
+            if(m_ints.size() < ndat)
+                m_ints.resize(ndat);
+            QkCodec::decodeInts(packet.buffer.constData() + i_data + 4*(total-ndat), ndat, m_ints.data());
+        }
+
+        // host time of the last sample is the receive time, minus link latency
+        const qint64 span = ((qint64) (nsamp-1) * interval) / 1000;
+        const qint64 rx = (qint64) packet.timestamp;
+        qint64 first = (qint64) (quint32) base + m_clockOffset.value(packet.address, 0);
+        if(!m_clockOffset.contains(packet.address) ||
+           first + span > rx || rx - (first + span) > ResyncThreshold)
+        {
+            first = rx - span;
+            m_clockOffset.insert(packet.address, first - (qint64) (quint32) base);
+        }
+
+        device->_logSamples(m_values.constData(), ndat, nsamp, (quint64) first, interval,
+                            integer ? m_ints.constData() : 0);
+        protocol->_publishData(packet.address, m_values.constData(), ndat, nsamp, (quint64) first, interval);
+
+        emit protocol->dataUpdated(packet.address, (quint64) first + span);
+        if(protocol->isDataReceivedConnected())
+            emit protocol->dataReceived(packet.address, device->data());
+    }
+
+private:
+    enum { ResyncThreshold = 1000 }; // ms
+    QVector<float> m_values;
+    QVector<qint32> m_ints;
+    QHash<int, qint64> m_clockOffset;
+};
+
+class QkEventHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        QkDevice *device = protocol->device(packet);
+        if(device == 0)
+            return;
+
+        int i, i_data = packet.dataOffset;
+        int eventID, nargs;
+        float arg;
+        QString message;
+        QkDevice::Event event;
+        QList<float> args;
+
+        if(!packet.read<QkPacket::EventLayout>(&i_data, &eventID, &nargs))
+        {
+            qWarning() << __FUNCTION__ << "truncated EVENT";
+            return;
+        }
+        for(i=0; i<nargs; i++)
+        {
+            if(!packet.read<QkCodec::Layout<QkCodec::Float>>(&i_data, &arg))
+            {
+                qWarning() << __FUNCTION__ << "truncated EVENT";
+                return;
+            }
+            args.append(arg);
+        }
+        // a missing NUL leaves the message empty rather than reading past the payload
+        packet.readString(&i_data, &message);
+
+        if(eventID >= device->events().size())
+        {
+            qWarning() << __FUNCTION__ << "event id greater than buffer capacity";
+            QkDevice::EventArray events(eventID+1);
+            for(i=0; i < events.count(); i++)
+                events[i]._setLabel(QString().sprintf("E%d",i));
+            device->_setEvents(events);
+        }
+        event._setLabel(device->events()[eventID].label());
+        event._setArgs(args);
+        event._setMessage(message);
+        device->_logEvent(event);
+
+        emit protocol->eventReceived(packet.address, event);
+    }
+};
+
+class QkStringHandler : public QkPacketHandler
+{
+public:
+    void handle(QkProtocol *protocol, const QkPacket &packet)
+    {
+        int i_data = packet.dataOffset;
+        QString str;
+        if(!packet.readString(&i_data, &str))
+        {
+            qWarning() << __FUNCTION__ << "unterminated STRING";
+            return;
+        }
+        emit protocol->debugReceived(packet.address, str);
+    }
+};
+
+void QkPacketHandler::registerDefaults(QkProtocol *protocol)
+{
+    protocol->registerHandler(QK_PACKET_CODE_ACK, new QkAckHandler());
+    protocol->registerHandler(QK_PACKET_CODE_READY, new QkReadyHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOQK, new QkInfoQkHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOBOARD, new QkInfoBoardHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOCONFIG, new QkInfoConfigHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOSAMP, new QkInfoSampHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFODATA, new QkInfoDataHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOEVENT, new QkInfoEventHandler());
+    protocol->registerHandler(QK_PACKET_CODE_INFOACTION, new QkInfoActionHandler());
+    protocol->registerHandler(QK_PACKET_CODE_DATA, new QkDataHandler());
+    protocol->registerHandler(QK_PACKET_CODE_DATABATCH, new QkDataBatchHandler());
+    protocol->registerHandler(QK_PACKET_CODE_EVENT, new QkEventHandler());
+    protocol->registerHandler(QK_PACKET_CODE_STRING, new QkStringHandler());
+}
@@ -0,0 +1,43 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKPACKETHANDLER_H
+#define QKPACKETHANDLER_H
+
+#include "qkcore_lib.h"
+
+class QkProtocol;
+class QkPacket;
+
+/**
+ * Handles every incoming packet of the code(s) it is registered for with
+ * QkProtocol::registerHandler(). Handlers run on the protocol worker
+ * thread and should keep any state they need as members, so only the
+ * codes actually received pay for decoding.
+ */
+class QKLIBSHARED_EXPORT QkPacketHandler
+{
+public:
+    virtual ~QkPacketHandler() {}
+    virtual void handle(QkProtocol *protocol, const QkPacket &packet) = 0;
+
+    static void registerDefaults(QkProtocol *protocol);
+};
+
+#endif // QKPACKETHANDLER_H
@@ -18,6 +18,8 @@
  */
 
 #include "qkprotocol.h"
+#include "qkpackethandler.h"
+#include "qksubscription.h"
 #include "qkcore.h"
 #include "qkboard.h"
 #include "qkdevice.h"
@@ -36,10 +38,11 @@
 #include <QStringList>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QMetaMethod>
 
-using namespace QkUtils;
+#include <string.h>
 
-int QkPacket::m_nextId = 0;
+using namespace QkUtils;
 
 int QkAck::toInt()
 {
@@ -55,156 +58,615 @@ QkAck QkAck::fromInt(int ack)
     return res;
 }
 
+bool QkAck::decode(const QkPacket &packet)
+{
+    int i_data = packet.dataOffset;
+    err = 0;
+    arg = 0;
+    if(!packet.read<QkPacket::AckLayout>(&i_data, &id, &code, &result))
+        return false;
+    if(result == ACK_ERROR)
+        return packet.read<QkPacket::AckErrorLayout>(&i_data, &err, &arg);
+    return true;
+}
+
+QkRequest::QkRequest(int id, int code, QObject *parent) :
+    QObject(parent)
+{
+    m_id = id;
+    m_code = code;
+    m_finished = false;
+    _setMaxWait(0, 2);
+    m_ack.id = id;
+    m_ack.code = code;
+}
+
+int QkRequest::id()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_id;
+}
+
+void QkRequest::_setMaxWait(int timeout, int retries)
+{
+    // every transmission may take up to the largest RTO (or the fixed
+    // timeout), plus one more for the time spent queued
+    const int transmission = qMax(timeout, (int) QkRttEstimator::MaxRto);
+    m_maxWait = (qMax(retries, 0) + 2) * transmission;
+}
+
+void QkRequest::_setId(int id)
+{
+    QMutexLocker locker(&m_mutex);
+    m_id = id;
+    m_ack.id = id;
+}
+
+bool QkRequest::isFinished()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_finished;
+}
+
+QkAck QkRequest::ack()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_ack;
+}
+
+QkAck QkRequest::waitForFinished(int timeout)
+{
+    QEventLoop loop;
+    QTimer timer;
+
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), &loop, SLOT(quit()));
+    connect(this, SIGNAL(finished(QkAck)), &loop, SLOT(quit()));
+
+    if(!isFinished())
+    {
+        timer.start(timeout >= 0 ? timeout : m_maxWait);
+        loop.exec();
+    }
+
+    // Bounded even when nobody can finish the request, e.g. when called
+    // from the thread that completes it.
+    QMutexLocker locker(&m_mutex);
+    if(!m_finished)
+    {
+        QkAck ack = m_ack;
+        ack.result = QkAck::ACK_NACK;
+        ack.err = QK_ERR_COMM_TIMEOUT;
+        return ack;
+    }
+    return m_ack;
+}
+
+void QkRequest::finish(const QkAck &ack)
+{
+    // Called from the protocol worker: the result is visible immediately to
+    // isFinished()/ack(), finished() is delivered in the request's thread.
+    m_mutex.lock();
+    m_ack = ack;
+    m_finished = true;
+    m_mutex.unlock();
+
+    QMetaObject::invokeMethod(this, "emitFinished", Qt::QueuedConnection);
+}
+
+void QkRequest::emitFinished()
+{
+    emit finished(ack());
+}
+
+QkRttEstimator::QkRttEstimator()
+{
+    m_srtt = 0.0;
+    m_rttvar = 0.0;
+    m_rto = InitialRto;
+    m_samples = 0;
+}
+
+void QkRttEstimator::addSample(int rtt)
+{
+    // Smoothed RTT and mean deviation as in TCP (RFC 6298).
+    if(m_samples == 0)
+    {
+        m_srtt = rtt;
+        m_rttvar = rtt / 2.0;
+    }
+    else
+    {
+        m_rttvar = 0.75 * m_rttvar + 0.25 * qAbs(m_srtt - rtt);
+        m_srtt = 0.875 * m_srtt + 0.125 * rtt;
+    }
+    m_samples++;
+
+    m_rto = qBound((int) MinRto, (int)(m_srtt + qMax((qreal) MinRto, 4.0 * m_rttvar)), (int) MaxRto);
+}
+
 QkProtocolWorker::QkProtocolWorker(QObject *parent) :
     QObject(parent)
 {
     m_quit = false;
+    m_verifyChecksum.store(0);
+    m_windowSize = 1;
+    m_nextId = 0;
+    m_fragments.reserve(16);
+    m_clock.start();
+}
+
+void QkProtocolWorker::setWindowSize(int size)
+{
+    QMutexLocker locker(&m_mutex);
+    m_windowSize = qBound(1, size, 255);
+    wakeUp();
+}
+
+int QkProtocolWorker::rto(int address)
+{
+    QMutexLocker locker(&m_mutex);
+    if(address >= 0 && m_nodeRtt.contains(address))
+        return m_nodeRtt[address].rto();
+    return m_rtt.rto();
+}
+
+QkRttEstimator* QkProtocolWorker::rttEstimator(int address)
+{
+    // Per-node estimate once the node has answered, the connection-wide
+    // estimate until then.
+    QHash<int, QkRttEstimator>::iterator it = m_nodeRtt.find(address);
+    if(it != m_nodeRtt.end() && it.value().samples() > 0)
+        return &it.value();
+    return &m_rtt;
 }
 
 void QkProtocolWorker::quit()
 {
+    QMutexLocker locker(&m_mutex);
     m_quit = true;
+    wakeUp();
+}
+
+void QkProtocolWorker::wakeUp()
+{
+    // Called with m_mutex held.
+    m_condition.wakeAll();
+    if(reactor() != 0)
+        reactor()->wakeUp(this);
 }
 
 void QkProtocolWorker::run()
 {
+    m_mutex.lock();
+    while(!m_quit)
+    {
+        m_mutex.unlock();
+        receivePending();
+        m_mutex.lock();
+
+        int nextTimeout = transmit();
+        if(m_quit)
+            break;
+
+        // Sleep until a frame arrives, a packet is queued, an ACK frees a
+        // slot in the window, the timer wheel ticks or quit() is called.
+        // receiveFrame() only takes the mutex to wake us while m_sleeping.
+        m_sleeping.fetchAndStoreOrdered(1);
+        if(m_rxRing.isEmpty())
+        {
+            if(nextTimeout >= 0)
+                m_condition.wait(&m_mutex, nextTimeout);
+            else
+                m_condition.wait(&m_mutex);
+        }
+        m_sleeping.fetchAndStoreOrdered(0);
+    }
+    abortAll();
+    m_mutex.unlock();
+
+    emit finished();
+}
+
+bool QkProtocolWorker::attach()
+{
+    QMutexLocker locker(&m_mutex);
+    m_quit = false;
+    return true;
+}
+
+void QkProtocolWorker::detach()
+{
+    QMutexLocker locker(&m_mutex);
+    m_quit = true;
+    abortAll();
+}
+
+int QkProtocolWorker::service()
+{
+    receivePending();
+
+    QMutexLocker locker(&m_mutex);
+    if(m_quit)
+        return -1;
+    return transmit();
+}
+
+int QkProtocolWorker::transmit()
+{
+    // Called with m_mutex held (released while frames are handed out).
+    // Sends everything the window allows and returns the time until the
+    // timer wheel must be advanced again (-1 if idle).
     QkFrame frame;
-    QEventLoop eventLoop;
+    QkFrameQueue frames;
 
-    while(!m_quit)
+    forever
     {
-        eventLoop.processEvents();
+        int nextTimeout = expirePending();
 
-        m_mutex.lock();
-        if(m_outputPacketsQueue.count() > 0)
+        if(!m_retransmitQueue.isEmpty())
         {
-            QkPacket packet = m_outputPacketsQueue.dequeue();
+            // Retransmissions already own a slot in the window.
+            frames.swap(m_retransmitQueue);
             m_mutex.unlock();
+            foreach(const QkFrame &retransmission, frames)
+                emit frameReady(retransmission);
+            frames.clear();
+            m_mutex.lock();
+            continue;
+        }
+
+        // The id is picked now, from this connection's free slots, so an
+        // id is never reused while its request waits for an ACK. The window
+        // keeps one free, but if none is the packet waits in its queue until
+        // an ACK or a timeout releases one.
+        QkPacket packet;
+        if(m_quit || m_timers.count() >= m_windowSize)
+            return nextTimeout;
+        const int id = freeId();
+        if(id < 0 || !nextPacket(&packet))
+            return nextTimeout;
+        m_nextId = (id + 1) % QkTimerWheel::Capacity;
+        packet.id = id;
+        if(!packet.tx.request.isNull())
+            packet.tx.request->_setId(id);
 
 //            qDebug() << "sendPacket dequeue";
 
-            frame.data.clear();
-            frame.data.append(packet.flags.ctrl & 0xFF);
-            frame.data.append((packet.flags.ctrl >> 8) & 0xFF);
-            frame.data.append(packet.id);
-            frame.data.append(packet.code);
-            frame.data.append(packet.data);
-
-            QkAck ack;
-
-//            do
-//            {
-                emit frameReady(frame);
-                if(packet.tx.waitACK)
-                    ack = waitForACK(packet.id, packet.tx.timeout);
-//            }
-//            while(packet.tx.waitACK && packet.tx.retries-- && ack.result == QkAck::NACK);
+        frame.data.clear();
+        frame.data.append(packet.flags.ctrl & 0xFF);
+        frame.data.append((packet.flags.ctrl >> 8) & 0xFF);
+        frame.data.append(packet.id);
+        frame.data.append(packet.code);
+        frame.data.append(packet.payload(), packet.dataLength);
+
+        if(packet.tx.waitACK)
+        {
+            const qint64 now = m_clock.elapsed();
+            Pending &pending = m_pending[packet.id];
+            pending.code = packet.code;
+            pending.address = packet.address;
+            pending.frame = frame.data;
+            pending.sentAt = now;
+            pending.adaptive = (packet.tx.timeout <= 0);
+            pending.timeout = (pending.adaptive ? rttEstimator(packet.address)->rto() : packet.tx.timeout);
+            pending.retries = packet.tx.retries;
+            pending.transmissions = 1;
+            pending.late = packet.tx.late;
+            pending.request = packet.tx.request;
+            m_timers.start(packet.id, now + pending.timeout, now);
+        }
+        m_mutex.unlock();
+
+        emit frameReady(frame);
+
+        m_mutex.lock();
+    }
+}
+
+void QkProtocolWorker::abortAll()
+{
+    // Called with m_mutex held. Nobody is going to answer the requests
+    // left behind.
+    for(int id = 0; id < QkTimerWheel::Capacity; id++)
+        if(m_timers.isActive(id))
+            failPending(id, QK_ERR_UNABLE_TO_SEND_MESSAGE);
+    for(int lane = 0; lane < QkPacket::Transmission::Priorities; lane++)
+        while(!m_outputQueues[lane].isEmpty())
+            finishUnsent(m_outputQueues[lane].dequeue(), QK_ERR_UNABLE_TO_SEND_MESSAGE);
+}
+
+bool QkProtocolWorker::nextPacket(QkPacket *packet)
+{
+    // Called with m_mutex held. Takes the oldest packet of the most urgent
+    // lane, dropping the ones whose deadline passed on the way.
+    const qint64 now = m_clock.elapsed();
+
+    for(int lane = 0; lane < QkPacket::Transmission::Priorities; lane++)
+    {
+        QkPacketQueue &queue = m_outputQueues[lane];
+        while(!queue.isEmpty())
+        {
+            *packet = queue.dequeue();
+            const QkPacket::Transmission &tx = packet->tx;
+            if(tx.deadline <= 0 || now - tx.queuedAt <= tx.deadline)
+                return true;
+
+            m_latePackets.ref();
+            if(!tx.dropLate)
+            {
+                packet->tx.late = true;
+                return true;
+            }
+            qWarning() << __FUNCTION__ << "deadline missed, dropped" << packet->codeFriendlyName();
+            finishUnsent(*packet, QK_ERR_COMM_TIMEOUT, true);
+        }
+    }
+    return false;
+}
+
+void QkProtocolWorker::finishUnsent(const QkPacket &packet, int err, bool late)
+{
+    if(packet.tx.request.isNull())
+        return;
+
+    QkAck ack;
+    ack.id = packet.id;
+    ack.code = packet.code;
+    ack.err = err;
+    ack.late = late;
+    packet.tx.request->finish(ack);
+}
+
+int QkProtocolWorker::expirePending()
+{
+    // Called with m_mutex held. Retransmits or fails requests whose ACK is
+    // overdue and returns the time until the wheel must be advanced again
+    // (-1 if idle).
+    int expired[QkTimerWheel::Capacity];
+    const qint64 now = m_clock.elapsed();
+    const int count = m_timers.expire(now, expired);
+
+    for(int i = 0; i < count; i++)
+    {
+        const int id = expired[i];
+        Pending &pending = m_pending[id];
+
+        if(pending.retries > 0)
+        {
+            QkFrame frame;
+            frame.data = pending.frame;
+            frame.timestamp = 0;
+            m_retransmitQueue.enqueue(frame);
+
+            // Exponential backoff for adaptive timeouts, fixed timeouts are
+            // honoured as given.
+            if(pending.adaptive)
+                pending.timeout = qMin(2 * pending.timeout, (int) QkRttEstimator::MaxRto);
+            pending.retries--;
+            pending.transmissions++;
+            pending.sentAt = now;
+            m_timers.start(id, now + pending.timeout, now);
+
+            qDebug() << "QkProtocolWorker retransmit" << id << "timeout" << pending.timeout;
         }
         else
-            m_mutex.unlock();
+        {
+            qDebug() << "QkProtocolWorker timeout!" << id;
+            failPending(id);
+        }
     }
-    eventLoop.processEvents();
 
-    emit finished();
+    return m_timers.timeToNextTick(now);
+}
+
+int QkProtocolWorker::freeId()
+{
+    // Called with m_mutex held. Round robin from the last id sent, so a
+    // late ACK for a request that timed out is unlikely to meet a new one.
+    for(int i = 0; i < QkTimerWheel::Capacity; i++)
+    {
+        const int id = (m_nextId + i) % QkTimerWheel::Capacity;
+        if(!m_timers.isActive(id))
+            return id;
+    }
+    return -1;
+}
+
+void QkProtocolWorker::failPending(int id, int err)
+{
+    Pending &pending = m_pending[id];
 
-    eventLoop.processEvents();
+    m_timers.stop(id);
+    pending.frame.clear();
+    if(!pending.request.isNull())
+    {
+        QkAck ack;
+        ack.id = id;
+        ack.code = pending.code;
+        ack.result = QkAck::ACK_NACK;
+        ack.err = err;
+        pending.request->finish(ack);
+        pending.request.clear();
+    }
 }
 
-void QkProtocolWorker::sendPacket(QkPacket packet)
+void QkProtocolWorker::sendPacket(const QkPacket &packet)
 {
     QMutexLocker locker(&m_mutex);
 
+    if(m_quit)
+    {
+        finishUnsent(packet, QK_ERR_UNABLE_TO_SEND_MESSAGE);
+        return;
+    }
+
 //    qDebug() << "sendPacket enqueue";
-    m_outputPacketsQueue.enqueue(packet);
+    const int lane = qBound(0, (int) packet.tx.priority, QkPacket::Transmission::Priorities - 1);
+    m_outputQueues[lane].enqueue(packet);
+    m_outputQueues[lane].last().tx.queuedAt = m_clock.elapsed();
+    wakeUp();
+
+    int count = 0;
+    for(int i = 0; i < QkPacket::Transmission::Priorities; i++)
+        count += m_outputQueues[i].count();
+    if(count > m_outputHighWater.load())
+        m_outputHighWater.store(count);
+}
+
+void QkProtocolWorker::receiveFrame(const QkFrame &frame)
+{
+    // Called on the link worker's thread: the frame is copied into a slot
+    // that keeps its buffer, and parsed on the protocol thread.
+    QkFrame *slot = m_rxRing.next();
+    if(slot == 0)
+    {
+        qWarning() << __FUNCTION__ << "input queue full, frame dropped";
+        return;
+    }
+    slot->data.resize(frame.data.count());
+    memcpy(slot->data.data(), frame.data.constData(), frame.data.count());
+    slot->timestamp = frame.timestamp;
+    m_rxRing.push();
+
+    if(reactor() != 0)
+        reactor()->wakeUp(this);
+    else if(m_sleeping.fetchAndAddOrdered(0) != 0)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_condition.wakeAll();
+    }
+}
 
-    if(m_outputPacketsQueue.count() > 8)
-        qDebug() << "OUTPUT PACKETS QUEUE IS GETTING FULL" << m_outputPacketsQueue.count();
+void QkProtocolWorker::receivePending()
+{
+    QkFrame *frame;
+    while((frame = m_rxRing.front()) != 0)
+    {
+        parseFrame(*frame);
+        m_rxRing.pop();
+    }
 }
 
-void QkProtocolWorker::parseFrame(QkFrame frame)
+void QkProtocolWorker::parseFrame(const QkFrame &frame)
 {
-    static QkPacket packet;
-    static QkPacket fragment;
+    QkPacket packet;
+
+    if(frame.data.count() < QK_FRAME_MIN_SIZE)
+    {
+        m_malformedFrames.ref();
+        return;
+    }
+    if(m_verifyChecksum.load() != 0 && !QkPacket::Builder::verify(frame))
+    {
+        m_checksumErrors.ref();
+        qWarning() << __FUNCTION__ << "checksum mismatch, frame dropped";
+        return;
+    }
 
     QkPacket::Builder::parse(frame, &packet);
 
     if(packet.flags.ctrl & QK_PACKET_FLAGMASK_CTRL_FRAG)
     {
-        fragment.data.append(packet.data);
-
-        //FIXME create elapsedTimer to timeout lastFragment reception
-        if(packet.flags.ctrl & QK_PACKET_FLAGMASK_CTRL_LASTFRAG)
-        {
-            packet.data = fragment.data;
-            fragment.data.clear();
-        }
-        else
+        if(!reassemble(&packet))
             return;
     }
-    processPacket(packet);
+    if(packet.code == QK_PACKET_CODE_ACK)
+    {
+        QkAck ack;
+        if(completeAck(packet, &ack))
+            emit ackReceived(packet, ack);
+        return;
+    }
     emit packetReady(packet);
 }
 
-void QkProtocolWorker::processPacket(QkPacket packet)
+bool QkProtocolWorker::reassemble(QkPacket *packet)
 {
-    QkPacket *p = &packet;
-    QkAck ack;
+    // Fragments are collected per source (address and board type), so
+    // sequences coming from different nodes may interleave freely.
+    const qint64 now = m_clock.elapsed();
+    const int key = (packet->address << 3) | packet->source();
 
-    int i_data = 0;
-    switch(p->code)
+    QHash<int, Fragment>::iterator it = m_fragments.find(key);
+    if(it == m_fragments.end())
     {
-    case QK_PACKET_CODE_ACK:
-        ack.id = getValue(1, &i_data, p->data);
-        ack.code = getValue(1, &i_data, p->data);
-        ack.result = getValue(1, &i_data, p->data);
-        if(ack.result == QkAck::ACK_ERROR)
-        {
-            ack.err = getValue(1, &i_data, p->data);
-            ack.arg = getValue(1, &i_data, p->data);
-        }
-        m_acks.prepend(ack);
-        break;
-    default: ;
+        it = m_fragments.insert(key, Fragment());
+        it.value().data.reserve(QK_FRAGMENT_RESERVE_SIZE);
+        it.value().active = false;
+    }
+    Fragment &fragment = it.value();
+
+    if(fragment.active && now - fragment.timestamp > QK_FRAGMENT_TIMEOUT)
+    {
+        qWarning() << __FUNCTION__ << "fragment sequence timed out, dropped";
+        m_droppedFragments.ref();
+        fragment.data.resize(0);
+        fragment.active = false;
+    }
+
+    if(fragment.data.count() + packet->dataLength > QK_FRAGMENT_MAX_SIZE)
+    {
+        qWarning() << __FUNCTION__ << "reassembled packet too long, dropped";
+        m_droppedFragments.ref();
+        fragment.data.resize(0);
+        fragment.active = false;
+        return false;
     }
+
+    fragment.data.append(packet->payload(), packet->dataLength);
+    fragment.timestamp = now;
+    fragment.active = true;
+
+    if(!(packet->flags.ctrl & QK_PACKET_FLAGMASK_CTRL_LASTFRAG))
+        return false;
+
+    // Hand out a copy so the preallocated buffer stays with the table.
+    packet->buffer = QByteArray(fragment.data.constData(), fragment.data.count());
+    packet->dataOffset = 0;
+    packet->dataLength = packet->buffer.count();
+    fragment.data.resize(0);
+    fragment.active = false;
+    return true;
 }
 
-QkAck QkProtocolWorker::waitForACK(int packetId, int timeout)
+bool QkProtocolWorker::completeAck(const QkPacket &packet, QkAck *ack)
 {
-    QEventLoop loop;
-    QTimer loopTimer;
-    QElapsedTimer elapsedTimer;
-    QkAck ack;
-
-    connect(&loopTimer, SIGNAL(timeout()), &loop, SLOT(quit()));
-    connect(this, SIGNAL(packetReady(QkPacket)), &loop, SLOT(quit()));
-//    connect(this, SIGNAL(packetProcessed()), &loop, SLOT(quit()));
+    // Decoded once, here: the waiting request is completed straight from
+    // the parse step and the model work (QkProtocol::processAck) follows.
+    QkRequestPtr request;
 
-    elapsedTimer.start();
+    if(!ack->decode(packet))
+    {
+        m_malformedFrames.ref();
+        return false;
+    }
 
-    while(ack.result == QkAck::ACK_NACK && !elapsedTimer.hasExpired(timeout))
+    m_mutex.lock();
+    if(ack->id >= 0 && ack->id < QkTimerWheel::Capacity && m_timers.isActive(ack->id))
     {
-        loopTimer.start(20);
-        loop.exec();
+        Pending &pending = m_pending[ack->id];
 
-        foreach(const QkAck &receivedAck, m_acks)
+        // Karn's rule: only unambiguous (not retransmitted) requests
+        // feed the RTT estimators.
+        if(pending.transmissions == 1)
         {
-            if(receivedAck.id == packetId)
-            {
-                ack = receivedAck;
-                break;
-            }
+            const int rtt = (int)(m_clock.elapsed() - pending.sentAt);
+            m_rtt.addSample(rtt);
+            m_nodeRtt[pending.address].addSample(rtt);
         }
-    }
 
-    m_acks.removeOne(ack);
-
-    loopTimer.stop();
-    if(elapsedTimer.hasExpired(timeout))
-    {
-        qDebug() << "QkProtocolWorker timeout!";
+        m_timers.stop(ack->id);
+        pending.frame.clear();
+        ack->late = pending.late;
+        request.swap(pending.request);
+        wakeUp();
     }
+    m_mutex.unlock();
 
-    return ack;
+    if(!request.isNull())
+        request->finish(*ack);
+    return true;
 }
 
 QkProtocol::QkProtocol(QkCore *qk) :
@@ -212,6 +674,9 @@ QkProtocol::QkProtocol(QkCore *qk) :
 {
     m_qk = qk;
 
+    memset(m_handlers, 0, sizeof(m_handlers));
+    QkPacketHandler::registerDefaults(this);
+
     m_workerThread = new QThread(this);
     m_protocolWorker = new QkProtocolWorker();
     m_protocolWorker->moveToThread(m_workerThread);
@@ -224,6 +689,8 @@ QkProtocol::QkProtocol(QkCore *qk) :
 
     connect(m_protocolWorker, SIGNAL(packetReady(QkPacket)),
             this, SLOT(processPacket(QkPacket)), Qt::DirectConnection);
+    connect(m_protocolWorker, SIGNAL(ackReceived(QkPacket,QkAck)),
+            this, SLOT(processAck(QkPacket,QkAck)), Qt::DirectConnection);
 
     m_workerThread->start();
 }
@@ -233,6 +700,12 @@ QkProtocol::~QkProtocol()
     m_protocolWorker->quit();
     m_workerThread->wait();
     delete m_protocolWorker;
+
+    for(int i = 0; i < 256; i++)
+        delete m_handlers[i];
+
+    foreach(QkSubscription *subscription, m_subscriptions)
+        subscription->_setProtocol(0);
 }
 
 //void QkProtocol::processFrame(const QkFrame &frame)
@@ -261,420 +734,170 @@ QkProtocol::~QkProtocol()
 
 
 
-QkAck QkProtocol::sendPacket(QkPacket::Descriptor descriptor, bool wait, int timeout, int retries)
+QkRequestPtr QkProtocol::sendPacketAsync(QkPacket::Descriptor descriptor, int timeout, int retries)
 {
-    QkAck ack;
     QkPacket packet;
     QkPacket::Builder::build(&packet, descriptor);
 
-//    do
-//    {
-    qDebug() << "sendPacket" << packet.codeFriendlyName() << QString().sprintf("code:%02X id=%d", packet.code, packet.id);
+    qDebug() << "sendPacketAsync" << packet.codeFriendlyName() << QString().sprintf("code:%02X id=%d", packet.code, packet.id);
+
+    QkRequestPtr request(new QkRequest(packet.id, packet.code), &QObject::deleteLater);
+    request->_setMaxWait(timeout, retries);
 
-    packet.tx.waitACK = wait;
+    packet.tx.waitACK = true;
     packet.tx.timeout = timeout;
     packet.tx.retries = retries;
+    packet.tx.request = request;
 
     emit packetReady(packet);
-    if(wait)
-        ack = waitForACK(packet.id, 3000);
-//    } while(wait && retries-- && ack.result == QkAck::NACK);
 
-    return ack;
+    return request;
 }
 
-QkAck QkProtocol::waitForACK(int packetId, int timeout)
+QkAck QkProtocol::sendPacket(QkPacket::Descriptor descriptor, bool wait, int timeout, int retries)
 {
-    QEventLoop loop;
-    QTimer loopTimer;
-    QElapsedTimer elapsedTimer;
-
-    connect(&loopTimer, SIGNAL(timeout()), &loop, SLOT(quit()));
-    connect(this, SIGNAL(packetProcessed()), &loop, SLOT(quit()));
-
-    elapsedTimer.start();
-
-    QkAck ack;
-
-    while(ack.result == QkAck::ACK_NACK && !elapsedTimer.hasExpired(timeout))
+    if(wait)
     {
-        loopTimer.start(50);
-        loop.exec();
-        foreach(const QkAck &receivedAck, m_acks)
-        {
-            if(receivedAck.id == packetId)
-            {
-                elapsedTimer.restart();
-                ack = receivedAck;
-                break;
-            }
-        }
+        // The worker finishes the request (ACK, timeout or shutdown); the
+        // wait is bounded in case this thread is the one that would.
+        QkRequestPtr request = sendPacketAsync(descriptor, timeout, retries);
+        return request->waitForFinished();
     }
-    loopTimer.stop();
 
-    if(elapsedTimer.hasExpired(timeout))
-    {
-        qDebug() << "QkProtocol timeout!";
-    }
+    QkPacket packet;
+    QkPacket::Builder::build(&packet, descriptor);
 
-    m_acks.removeOne(ack);
+    qDebug() << "sendPacket" << packet.codeFriendlyName() << QString().sprintf("code:%02X id=%d", packet.code, packet.id);
 
-    return ack;
-}
+    packet.tx.waitACK = false;
+    packet.tx.timeout = timeout;
+    packet.tx.retries = retries;
 
-void QkProtocol::processPacket(QkPacket packet)
-{
-    QkBoard *selBoard = 0;
-    QkNode *selNode = 0;
-    QkComm *selComm = 0;
-    QkDevice *selDevice = 0;
-    bool boardCreated = false;
+    emit packetReady(packet);
 
-    QkPacket *p = &packet;
-    QkCore *qk = m_qk;
+    return QkAck();
+}
 
-    qDebug() << __FUNCTION__ <<  p->codeFriendlyName() << QString().sprintf("addr:%04X code:%02X",p->address,p->code);
+void QkProtocol::registerHandler(int code, QkPacketHandler *handler)
+{
+    code &= 0xFF;
+    if(m_handlers[code] != handler)
+        delete m_handlers[code];
+    m_handlers[code] = handler;
+}
 
-    selNode = qk->node(p->address);
-    if(selNode == 0)
+QkBoard* QkProtocol::board(const QkPacket &packet)
+{
+    QkNode *node = m_qk->node(packet.address);
+    if(node == 0)
     {
-        selNode = new QkNode(qk, p->address);
-        qk->m_nodes.insert(p->address, selNode);
+        node = new QkNode(m_qk, packet.address);
+        m_qk->m_nodes.insert(packet.address, node);
     }
 
-    switch(p->source())
+    switch(packet.source())
     {
     case QkBoard::btComm:
-        if(selNode->comm() == 0)
-        {
-            selNode->setComm(new QkComm(qk, selNode));
-            boardCreated = true;
-        }
-        selComm = selNode->comm();
-        selBoard = selNode->comm();
-        break;
+        if(node->comm() == 0)
+            node->setComm(new QkComm(m_qk, node));
+        return node->comm();
     case QkBoard::btDevice:
-        if(selNode->device() == 0)
-        {
-            selDevice = new QkDevice(qk, selNode);
-            selNode->setDevice(selDevice);
-            boardCreated = true;
-        }
-        selDevice = selNode->device();
-        selBoard = (QkBoard*)(selDevice);
-        break;
+        if(node->device() == 0)
+            node->setDevice(new QkDevice(m_qk, node));
+        return node->device();
     default:
         qWarning() << __FUNCTION__ << "unkown packet source";
     }
+    return 0;
+}
 
-    if(selBoard == 0)
+QkDevice* QkProtocol::device(const QkPacket &packet)
+{
+    if(packet.source() != QkBoard::btDevice)
     {
-        qWarning() << __FUNCTION__ << "selBoard == 0";
-        return;
+        qWarning() << __FUNCTION__ << "packet not sent by a device" << QString().sprintf("(%02X)", packet.code);
+        return 0;
     }
+    return (QkDevice*) board(packet);
+}
 
-    int i, j, size, fwVersion, ncfg, ndat, nact, nevt, eventID, nargs;
-    int year, month, day, hours, minutes, seconds;
-    double min = 0.0, max = 0.0;
-    float dataValue;
-    QString debugStr;
-    QkInfo qkInfo;
+// For a worker serviced by a QkReactor from now on.
+void QkProtocol::_stopWorkerThread()
+{
+    if(m_workerThread->isRunning())
+    {
+        m_protocolWorker->quit();
+        m_workerThread->wait();
+    }
+}
 
-    QkBoard::ConfigArray configs;
-    QkBoard::Config::Type configType;
+bool QkProtocol::isDataReceivedConnected() const
+{
+    static const QMetaMethod signal = QMetaMethod::fromSignal(&QkProtocol::dataReceived);
+    return isSignalConnected(signal);
+}
 
-    QkDevice::SamplingInfo sampInfo;
-    QkDevice::DataArray data;
-    QkDevice::Data::Type dataType;
-    QkDevice::EventArray events;
-    QkDevice::Event eventRx;
-    QkDevice::ActionArray actions;
-
-    QString label, name;
-    QVariant varValue;
-    QStringList items;
-    QDateTime dateTime;
+void QkProtocol::subscribe(QkSubscription *subscription)
+{
+    QMutexLocker locker(&m_subscriptionsMutex);
+    subscription->_setProtocol(this);
+    m_subscriptions.insert(subscription->address(), subscription);
+}
 
-    QList<float> eventArgs;
-    float eventArg;
-    bool bufferJustCreated = false;
-    bool infoChangedEmit = false;
-    int infoChangedMask = 0;
-    QkAck ackRx;
+void QkProtocol::unsubscribe(QkSubscription *subscription)
+{
+    QMutexLocker locker(&m_subscriptionsMutex);
+    m_subscriptions.remove(subscription->address(), subscription);
+    subscription->_setProtocol(0);
+}
 
-    int i_data = 0;
-    switch(p->code)
+// Holds the lock while pushing, so a subscription being deleted on another
+// thread waits for the push to finish.
+void QkProtocol::_publishData(int address, const float *values, int channels, int samples,
+                              quint64 timestamp, int interval)
+{
+    QMutexLocker locker(&m_subscriptionsMutex);
+    QMultiHash<int, QkSubscription*>::const_iterator it = m_subscriptions.constFind(address);
+    while(it != m_subscriptions.constEnd() && it.key() == address)
     {
-    case QK_PACKET_CODE_ACK:
-        ackRx.id = getValue(1, &i_data, p->data);
-        ackRx.code = getValue(1, &i_data, p->data);
-        ackRx.result = getValue(1, &i_data, p->data);
-        if(ackRx.result == QkAck::ACK_ERROR)
-        {
-            ackRx.err = getValue(1, &i_data, p->data);
-            ackRx.arg = getValue(1, &i_data, p->data);
-        }
-        m_acks.prepend(ackRx);
-        qDebug() << " ACK received:" << QString().sprintf("id:%d code:%02X result:%d", ackRx.id, ackRx.code, ackRx.result);
-        break;
-    case QK_PACKET_CODE_READY:
-        qk->m_ready = true;
-        break;
-    case QK_PACKET_CODE_INFOQK:
-        qkInfo.version = Version(getValue(1, &i_data, p->data),
-                                 getValue(1, &i_data, p->data),
-                                 getValue(1, &i_data, p->data));
-        qkInfo.baudRate = getValue(4, &i_data, p->data);
-        qkInfo.flags = getValue(4, &i_data, p->data);
-        selBoard->_setQkInfo(qkInfo);
-        selBoard->_setInfoMask((int)QkBoard::biQk);
-        break;
-    case QK_PACKET_CODE_INFOBOARD:
-        fwVersion = getValue(2, &i_data, p->data);
-        name = getString(QK_BOARD_NAME_SIZE, &i_data, p->data);
-        selBoard->_setFirmwareVersion(fwVersion);
-        selBoard->_setName(name);
-        selBoard->_setInfoMask((int)QkBoard::biBoard);
-        break;
-    case QK_PACKET_CODE_INFOCONFIG:
-        ncfg = getValue(1, &i_data, p->data);
-        configs = QVector<QkBoard::Config>(ncfg);
-        for(i=0; i<ncfg; i++)
-        {
-            configType = (QkBoard::Config::Type) getValue(1, &i_data, p->data);
-            label = getString(QK_LABEL_SIZE, &i_data, p->data);
-            switch(configType)
-            {
-            case QkBoard::Config::ctBool:
-                varValue = QVariant((bool) getValue(1, &i_data, p->data));
-                break;
-            case QkBoard::Config::ctIntDec:
-                varValue = QVariant((int) getValue(4, &i_data, p->data, true));
-                min = (double) getValue(4, &i_data, p->data, true);
-                max = (double) getValue(4, &i_data, p->data, true);
-                break;
-            case QkBoard::Config::ctIntHex:
-                varValue = QVariant((unsigned int) getValue(4, &i_data, p->data, true));
-                min = (double) getValue(4, &i_data, p->data, true);
-                max = (double) getValue(4, &i_data, p->data, true);
-                break;
-            case QkBoard::Config::ctFloat:
-                varValue = QVariant(floatFromBytes(getValue(4, &i_data, p->data, true)));
-                min = (double) getValue(4, &i_data, p->data, true);
-                max = (double) getValue(4, &i_data, p->data, true);
-                break;
-            case QkBoard::Config::ctDateTime:
-                year = 2000+getValue(1, &i_data, p->data);
-                month = getValue(1, &i_data, p->data);
-                day = getValue(1, &i_data, p->data);
-                hours = getValue(1, &i_data, p->data);
-                minutes = getValue(1, &i_data, p->data);
-                seconds = getValue(1, &i_data, p->data);
-                dateTime = QDateTime(QDate(year,month,day),QTime(hours,minutes,seconds));
-                varValue = QVariant(dateTime);
-                break;
-            case QkBoard::Config::ctTime:
-                hours = getValue(1, &i_data, p->data);
-                minutes = getValue(1, &i_data, p->data);
-                seconds = getValue(1, &i_data, p->data);
-                dateTime = QDateTime(QDate::currentDate(),QTime(hours,minutes,seconds));
-                varValue = QVariant(dateTime);
-                break;
-            case QkBoard::Config::ctCombo:
-                size = getValue(1, &i_data, p->data);
-                items.clear();
-                for(i=0; i<size; i++)
-                {
-                    items.append(getString(&i_data, p->data));
-                }
-                varValue = QVariant(items);
-                break;
-            }
-            configs[i]._set(label, configType, varValue, min, max);
-        }
-        selBoard->_setConfigs(configs);
-        selBoard->_setInfoMask((int)QkBoard::biConfig);
-        break;
-    case QK_PACKET_CODE_INFOSAMP:
-        sampInfo.frequency = getValue(4, &i_data, p->data);
-        sampInfo.mode = (QkDevice::SamplingMode) getValue(1, &i_data, p->data);
-        sampInfo.triggerClock = (QkDevice::TriggerClock) getValue(1, &i_data, p->data);
-        sampInfo.triggerScaler = getValue(1, &i_data, p->data);
-        sampInfo.N = getValue(4, &i_data, p->data);
-        selDevice->_setSamplingInfo(sampInfo);
-        selDevice->_setInfoMask((int)QkDevice::diSampling);
-        break;
-    case QK_PACKET_CODE_INFODATA:
-        ndat = getValue(1, &i_data, p->data);
-        data = QVector<QkDevice::Data>(ndat);
-        dataType = (QkDevice::Data::Type)getValue(1, &i_data, p->data);
-        for(i=0; i<ndat; i++)
-        {
-            data[i]._setLabel(getString(QK_LABEL_SIZE, &i_data, p->data));
-        }
-        selDevice->_setDataType(dataType);
-        selDevice->_setData(data);
-        selDevice->_setInfoMask((int)QkDevice::diData);
-        break;
-    case QK_PACKET_CODE_INFOEVENT:
-        nevt = getValue(1, &i_data, p->data);
-        events = QVector<QkDevice::Event>(nevt);
-        for(i=0; i<nevt; i++)
-        {
-            events[i]._setLabel(getString(QK_LABEL_SIZE, &i_data, p->data));
-        }
-        selDevice->_setEvents(events);
-        selDevice->_setInfoMask((int)QkDevice::diEvent);
-        break;
-    case QK_PACKET_CODE_INFOACTION:
-        nact = getValue(1, &i_data, p->data);
-        actions = QVector<QkDevice::Action>(nact);
-        for(i = 0; i < nact; i++)
-        {
-            actions[i]._setType((QkDevice::Action::Type)getValue(1, &i_data, p->data));
-            actions[i]._setLabel(getString(QK_LABEL_SIZE, &i_data, p->data));
-            switch(actions[i].type())
-            {
-            case QkDevice::Action::atBool:
-                actions[i]._setValue(QVariant((bool) getValue(1, &i_data, p->data)));
-                break;
-            case QkDevice::Action::atInt:
-                actions[i]._setValue(QVariant((int) getValue(4, &i_data, p->data)));
-                break;
-            }
-        }
-        selDevice->_setActions(actions);
-        selDevice->_setInfoMask((int)QkDevice::diAction);
-        break;
-    case QK_PACKET_CODE_DATA:
-        ndat = getValue(1, &i_data, p->data);
-        dataType = (QkDevice::Data::Type)getValue(1, &i_data, p->data);
-        if(selDevice->data().size() != ndat)
-        {
-            qWarning() << __FUNCTION__ << "data count doesn't match buffer size";
-            data.resize(ndat);
-            selDevice->_setData(data);
-            selDevice->_setDataType(dataType);
-            bufferJustCreated = true;
-            infoChangedEmit = true;
-            infoChangedMask |= (int)QkDevice::diData;
-        }
-        for(i=0; i<ndat; i++)
-        {
-            if(dataType == QkDevice::Data::dtInt)
-                dataValue = getValue(4, &i_data, p->data, true);
-            else
-                dataValue = floatFromBytes(getValue(4, &i_data, p->data, true));
-            selDevice->_setDataValue(i, dataValue, p->timestamp);
-            if(bufferJustCreated)
-                selDevice->_setDataLabel(i, QString().sprintf("D%d",i));
-        }
-        selDevice->_logData(selDevice->data());
-        break;
-    case QK_PACKET_CODE_EVENT:
-        eventID = getValue(1, &i_data, p->data);
-        if(eventID >= selDevice->events().size())
-        {
-            qWarning() << __FUNCTION__ << "event id greater than buffer capacity";
-            events.resize(eventID+1);
-            for(i=0; i < events.count(); i++)
-                events[i]._setLabel(QString().sprintf("E%d",i));
-            selDevice->_setEvents(events);
-            bufferJustCreated = true;
-            infoChangedEmit = true;
-            infoChangedMask |= (int)QkDevice::diEvent;
-        }
-        eventRx._setLabel(selDevice->events()[eventID].label());
-        nargs = getValue(1, &i_data, p->data);
-        eventArgs.clear();
-        for(i=0; i<nargs; i++)
-        {
-            eventArg = floatFromBytes(getValue(4, &i_data, p->data, true));
-            eventArgs.append(eventArg);
-        }
-        eventRx._setArgs(eventArgs);
-        eventRx._setMessage(getString(&i_data, p->data));
-//        if(!m_eventLogging)
-//            selDevice->eventsFired()->clear();
-        selDevice->_logEvent(eventRx);
-        break;
-    case QK_PACKET_CODE_STRING:
-        debugStr = getString(&i_data, p->data);
-        break;
-//    case QK_PACKET_CODE_OK: //FIXME not tested
-//        m_protocol.ack.code = QK_COMM_OK;
-//        m_protocol.ack.arg = getValue(1, &i_data, p->data);
-//        break;
-//    case QK_PACKET_CODE_ERR: //FIXME not tested
-//        m_protocol.ack.code = QK_COMM_ERR;
-//        m_protocol.ack.err = getValue(4, &i_data, p->data);
-//        m_protocol.ack.arg = getValue(4, &i_data, p->data);
-//        break;
-    default:
-        //m_protocol->ack().type = QkAck::ERROR;
-        //m_protocol->ack().err = QK_ERR_CODE_UNKNOWN;
-        //m_protocol->ack().arg = p->code;
-        qWarning() << __FUNCTION__ << "packet code not recognized" << QString().sprintf("(%02X)", p->code);
+        it.value()->_push(values, channels, samples, timestamp, interval);
+        ++it;
     }
+}
 
-//    switch(p->code)
-//    {
-//    case QK_PACKET_CODE_SEQBEGIN:
-//    case QK_PACKET_CODE_SEQEND:
-//    case QK_PACKET_CODE_OK:
-//    case QK_PACKET_CODE_ERR:
-//        break;
-//    default:
-//        if(!(p->flags.ctrl & QK_PACKET_FLAGMASK_CTRL_NOTIF))
-//        {
-//            if(!m_protocol.sequence && m_protocol.ack.err != QK_ERR_CODE_UNKNOWN)
-//            {
-//                m_protocol.ack.code = QK_COMM_ACK;
-//                m_protocol.ack.arg = p->code;
-//            }
-//        }
-//    }
+void QkProtocol::processPacket(const QkPacket &packet)
+{
+#ifdef QK_DEBUG_FRAMES
+    qDebug() << __FUNCTION__ <<  packet.codeFriendlyName() << QString().sprintf("addr:%04X code:%02X",packet.address,packet.code);
+#endif
 
-//    if(infoChangedEmit)
-//        emit infoChanged(p->address, (QkBoard::Type)p->source(), infoChangedMask);
+    QkPacketHandler *handler = m_handlers[packet.code & 0xFF];
+    if(handler != 0)
+        handler->handle(this, packet);
+    else
+        qWarning() << __FUNCTION__ << "packet code not recognized" << QString().sprintf("(%02X)", packet.code);
 
-    switch(p->code)
-    {
-    case QK_PACKET_CODE_ACK:
-        emit ack(ackRx);
-        if(ackRx.code == QK_PACKET_CODE_SEARCH)
-        {
-            switch(p->source())
-            {
-            case QkBoard::btComm: emit commFound(selNode->address()); break;
-            case QkBoard::btDevice: emit deviceFound(selNode->address()); break;
-            }
-        }
-        else if((ackRx.code == QK_PACKET_CODE_GETNODE && p->source() == QkBoard::btComm) ||
-                ackRx.code == QK_PACKET_CODE_GETMODULE)
-        {
-            emit commUpdated(selNode->address());
-        }
-        else if((ackRx.code == QK_PACKET_CODE_GETNODE && p->source() == QkBoard::btDevice) ||
-                ackRx.code == QK_PACKET_CODE_GETDEVICE)
-        {
-            emit deviceUpdated(selNode->address());
-        }
+    emit packetProcessed();
+}
 
+void QkProtocol::processAck(const QkPacket &packet, const QkAck &ack)
+{
+#ifdef QK_DEBUG_FRAMES
+    qDebug() << __FUNCTION__ << QString().sprintf("id:%d code:%02X result:%d", ack.id, ack.code, ack.result);
+#endif
+
+    emit this->ack(ack);
+
+    // The request is already complete; only discovery ACKs resolve a node.
+    switch(ack.code)
+    {
+    case QK_PACKET_CODE_SEARCH:
+    case QK_PACKET_CODE_GETNODE:
+    case QK_PACKET_CODE_GETMODULE:
+    case QK_PACKET_CODE_GETDEVICE:
+        if(m_handlers[QK_PACKET_CODE_ACK] != 0)
+            m_handlers[QK_PACKET_CODE_ACK]->handle(this, packet);
         break;
-    case QK_PACKET_CODE_DATA:
-        emit dataReceived(selNode->address(), selDevice->data());
-        break;
-    case QK_PACKET_CODE_EVENT:
-        //emit eventReceived(selNode->address(), firedEvent);
-        emit eventReceived(selNode->address(), eventRx);
-        break;
-    case QK_PACKET_CODE_STRING:
-        emit debugReceived(selNode->address(), debugStr);
-        break;
-//    case QK_PACKET_CODE_ERR:
-//        emit error(m_protocol.ack.err, m_protocol.ack.arg);
-//        break;
     default: ;
     }
 
@@ -682,18 +905,46 @@ void QkProtocol::processPacket(QkPacket packet)
 }
 
 
+QkPacket::Transmission::Priority QkPacket::Transmission::priorityOf(int code)
+{
+    switch(code & 0xFF)
+    {
+    case QK_PACKET_CODE_ACTUATE:
+    case QK_PACKET_CODE_START:
+    case QK_PACKET_CODE_STOP:
+    case QK_PACKET_CODE_HELLO:
+    case QK_PACKET_CODE_WAKEUP:
+        return Control;
+    case QK_PACKET_CODE_SETQK:
+    case QK_PACKET_CODE_SETNAME:
+    case QK_PACKET_CODE_SETSAMP:
+    case QK_PACKET_CODE_SETCALENDAR:
+    case QK_PACKET_CODE_SETCONFIG:
+    case QK_PACKET_CODE_SETBAUD:
+    case QK_PACKET_CODE_SETFREQ:
+    case QK_PACKET_CODE_SAVE:
+    case QK_PACKET_CODE_RESTORE:
+        return Configuration;
+    default:
+        return Discovery;
+    }
+}
+
 bool QkPacket::Builder::build(QkPacket *packet, const Descriptor &desc)
 {
     qDebug() << "build packet with code" << QString().sprintf("%02X", desc.code & 0xFF);
 
-    int i_data;
     QkDevice *device = 0;
 
     packet->flags.ctrl = 0;
     packet->address = desc.address;
-    packet->id = QkPacket::requestId();
+    packet->id = -1; // picked by the protocol worker when it is sent
     packet->code = desc.code;
-    packet->data.clear();
+    packet->buffer.clear();
+    packet->tx.priority = (desc.priority >= 0 ? (Transmission::Priority) desc.priority
+                                              : Transmission::priorityOf(desc.code));
+    packet->tx.deadline = desc.deadline;
+    packet->tx.dropLate = desc.dropLate;
 
     QkBoard *board = desc.board;
 
@@ -712,48 +963,51 @@ bool QkPacket::Builder::build(QkPacket *packet, const Descriptor &desc)
     QkDevice::SamplingInfo sampInfo;
     QVector<QkBoard::Config> configs;
     QVariant configValue;
-    QkDevice::Action *act;
+    QDateTime dateTime;
+    QTime time;
+    QkDevice::Action act;
+
+    using namespace QkCodec;
 
-    i_data = 0;
     switch(desc.code)
     {
     case QK_PACKET_CODE_GETNODE:
-        fillValue(desc.getnode_address, 4, &i_data, packet->data);
+        append<GetNodeLayout>(&packet->buffer, desc.getnode_address);
         break;
     case QK_PACKET_CODE_SETNAME:
-        fillString(desc.setname_str, QK_BOARD_NAME_SIZE, &i_data, packet->data);
+        append<SetNameLayout>(&packet->buffer, desc.setname_str);
         break;
     case QK_PACKET_CODE_SETCONFIG:
         configs = board->configs();
-        fillValue(1, 1, &i_data, packet->data);
-        fillValue(desc.setconfig_idx, 1, &i_data, packet->data);
+        append<SetConfigLayout>(&packet->buffer, 1, desc.setconfig_idx);
         configValue = configs[desc.setconfig_idx].value();
         switch(configs[desc.setconfig_idx].type())
         {
         case QkBoard::Config::ctBool:
-            fillValue(configValue.toInt(), 1, &i_data, packet->data);
+            append<Layout<UInt<1>>>(&packet->buffer, configValue.toInt());
             break;
         case QkBoard::Config::ctIntDec:
-            fillValue(configValue.toInt(), 4, &i_data, packet->data);
+            append<Layout<UInt<4>>>(&packet->buffer, configValue.toInt());
             break;
         case QkBoard::Config::ctIntHex:
-            fillValue(configValue.toUInt(), 4, &i_data, packet->data);
+            append<Layout<UInt<4>>>(&packet->buffer, (int) configValue.toUInt());
             break;
         case QkBoard::Config::ctFloat:
-            fillValue(bytesFromFloat(configValue.toFloat()), 4, &i_data, packet->data);
+            append<Layout<Float>>(&packet->buffer, configValue.toFloat());
             break;
         case QkBoard::Config::ctDateTime:
-            fillValue(configValue.toDateTime().date().year()-2000, 1, &i_data, packet->data);
-            fillValue(configValue.toDateTime().date().month(), 1, &i_data, packet->data);
-            fillValue(configValue.toDateTime().date().day(), 1, &i_data, packet->data);
-            fillValue(configValue.toDateTime().time().hour(), 1, &i_data, packet->data);
-            fillValue(configValue.toDateTime().time().minute(), 1, &i_data, packet->data);
-            fillValue(configValue.toDateTime().time().second(), 1, &i_data, packet->data);
+            dateTime = configValue.toDateTime();
+            append<DateTimeLayout>(&packet->buffer,
+                                   dateTime.date().year()-2000,
+                                   dateTime.date().month(),
+                                   dateTime.date().day(),
+                                   dateTime.time().hour(),
+                                   dateTime.time().minute(),
+                                   dateTime.time().second());
             break;
         case QkBoard::Config::ctTime:
-            fillValue(configValue.toTime().hour(), 1, &i_data, packet->data);
-            fillValue(configValue.toTime().minute(), 1, &i_data, packet->data);
-            fillValue(configValue.toTime().second(), 1, &i_data, packet->data);
+            time = configValue.toTime();
+            append<TimeLayout>(&packet->buffer, time.hour(), time.minute(), time.second());
             break;
         case QkBoard::Config::ctCombo:
             qDebug() << "Config::ctCombo";
@@ -764,28 +1018,31 @@ bool QkPacket::Builder::build(QkPacket *packet, const Descriptor &desc)
         break;
     case QK_PACKET_CODE_SETSAMP:
         sampInfo = device->samplingInfo();
-        fillValue(sampInfo.frequency, 4, &i_data, packet->data);
-        fillValue(sampInfo.mode, 1, &i_data, packet->data);
-        fillValue((int)(sampInfo.triggerClock), 1, &i_data, packet->data);
-        fillValue((int)(sampInfo.triggerScaler), 1, &i_data, packet->data);
-        fillValue(sampInfo.N, 4, &i_data, packet->data);
+        append<SampLayout>(&packet->buffer,
+                           sampInfo.frequency,
+                           (int) sampInfo.mode,
+                           (int) sampInfo.triggerClock,
+                           sampInfo.triggerScaler,
+                           sampInfo.N);
         break;
     case QK_PACKET_CODE_ACTUATE:
-        act = &(device->actions()[desc.action_id]);
-        fillValue(desc.action_id, 1, &i_data, packet->data);
-        fillValue((int)(act->type()), 1, &i_data, packet->data);
-        switch (act->type())
+        act = device->actions().value(desc.action_id);
+        append<ActuateLayout>(&packet->buffer, desc.action_id, (int) act.type());
+        switch (act.type())
         {
         case QkDevice::Action::atBool:
-            fillValue((int)(act->value().toBool()), 1, &i_data, packet->data);
+            append<Layout<UInt<1>>>(&packet->buffer, (int) act.value().toBool());
             break;
         case QkDevice::Action::atInt:
-            fillValue(act->value().toInt(), 4, &i_data, packet->data);
+            append<Layout<UInt<4>>>(&packet->buffer, act.value().toInt());
             break;
         }
         break;
     }
 
+    packet->dataOffset = 0;
+    packet->dataLength = packet->buffer.count();
+
     return true;
 }
 
@@ -801,36 +1058,60 @@ bool QkPacket::Builder::validate(Descriptor *pd)
     return ok;
 }
 
-void QkPacket::Builder::parse(const QkFrame &frame, QkPacket *packet)
+bool QkPacket::Builder::verify(const QkFrame &frame)
 {
-    int i_data = 0;
-
-    QByteArray data = frame.data;
+    const int count = frame.data.count();
+    if(count < QK_FRAME_MIN_SIZE)
+        return false;
 
-    packet->calculateHeaderLenght();
+    const char *data = frame.data.constData();
+    return QkPacket::checksum(data, count - SIZE_CHECKSUM) == (quint8) data[count - 1];
+}
 
-    packet->checksum = (int) data.at(data.length() - 1);
+void QkPacket::Builder::parse(const QkFrame &frame, QkPacket *packet)
+{
+    int i_data = 0;
+    const QByteArray &data = frame.data;
 
-    packet->flags.ctrl = getValue(2, &i_data, data);
+    // frames shorter than QK_FRAME_MIN_SIZE are dropped before parsing
+    packet->checksum = (quint8) data.at(data.count() - 1);
+    QkCodec::read<Header>(data.constData(), data.count(), &i_data, &packet->flags.ctrl, &packet->code);
     packet->address = 0;
     packet->timestamp = frame.timestamp;
+    packet->calculateHeaderLenght();
 
-    packet->code = getValue(1, &i_data, data);
-
-    packet->data.clear();
-    packet->data.append(data.right(data.count() - i_data));
-    packet->data.truncate(packet->data.count() - 1); // remove checksum byte
+    // The payload is not copied: the packet shares the frame's buffer and
+    // only records where the payload starts (the checksum byte is excluded).
+    packet->buffer = data;
+    packet->dataOffset = i_data;
+    packet->dataLength = data.count() - i_data - SIZE_CHECKSUM;
 }
 
 
 
-int QkPacket::requestId()
+quint8 QkPacket::checksum(const char *data, int count)
 {
-    m_nextId = (m_nextId+1) % 256;
-    return m_nextId;
+    // XOR of all bytes. Whole machine words are folded together first and
+    // the accumulator is reduced to a byte at the end.
+    quint64 word, acc = 0;
+    while(count >= (int) sizeof(word))
+    {
+        memcpy(&word, data, sizeof(word));
+        acc ^= word;
+        data += sizeof(word);
+        count -= sizeof(word);
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+
+    quint8 sum = (quint8) acc;
+    while(count-- > 0)
+        sum ^= (quint8) *data++;
+    return sum;
 }
 
-int QkPacket::source()
+int QkPacket::source() const
 {
     return (QkBoard::Type) ((flags.ctrl >> 4) & 0x07);
 }
@@ -846,7 +1127,7 @@ void QkPacket::calculateHeaderLenght()
       headerLength += SIZE_FLAGS_NETWORK;
 }
 
-QString QkPacket::codeFriendlyName()
+QString QkPacket::codeFriendlyName() const
 {
     switch((quint8)code)
     {
@@ -888,6 +1169,8 @@ QString QkPacket::codeFriendlyName()
         return "INFO_CONFIG";
     case QK_PACKET_CODE_DATA:
         return "DATA";
+    case QK_PACKET_CODE_DATABATCH:
+        return "DATA_BATCH";
     case QK_PACKET_CODE_EVENT:
         return "EVENT";
     case QK_PACKET_CODE_STATUS:
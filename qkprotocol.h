@@ -37,6 +37,11 @@ typedef enum qk_error
 
 
 #include "qkcore_lib.h"
+#include "qkcore_constants.h"
+#include "qktimerwheel.h"
+#include "qkcodec.h"
+#include "qkreactor.h"
+#include "qkring.h"
 #include <stdint.h>
 
 #include <QObject>
@@ -44,6 +49,10 @@ typedef enum qk_error
 #include <QReadWriteLock>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QHash>
 
 #define QK_COMM_WAKEUP      0x00
 #define QK_COMM_FLAG        0x55	// Flag
@@ -102,6 +111,9 @@ typedef enum qk_error
 #define QK_PACKET_CODE_CALENDAR         0xD1
 #define QK_PACKET_CODE_STATUS           0xD5
 #define QK_PACKET_CODE_DATA             0xD0
+// Host-side extension: no firmware sends it yet. Only accepted from boards
+// that set QK_FLAGMASK_DATABATCH in INFOQK.
+#define QK_PACKET_CODE_DATABATCH        0xD3
 #define QK_PACKET_CODE_EVENT            0xDE
 #define QK_PACKET_CODE_STRING           0xDF
 
@@ -119,11 +131,25 @@ typedef enum qk_error
 #define SIZE_ADDR16         2
 #define SIZE_ADDR64         8
 
+#define SIZE_CHECKSUM       1
+
+#define QK_FRAME_MIN_SIZE   (SIZE_FLAGS_CTRL + SIZE_CODE + SIZE_CHECKSUM)
+#define QK_FRAME_MAX_SIZE   1024
+
+#define QK_FRAGMENT_RESERVE_SIZE    1024
+#define QK_FRAGMENT_MAX_SIZE        16384
+#define QK_FRAGMENT_TIMEOUT         1000
+
 #include "qkdevice.h"
 
 class QkCore;
 class QkBoard;
 class QkProtocol;
+class QkPacketHandler;
+class QkSubscription;
+class QkRequest;
+
+typedef QSharedPointer<QkRequest> QkRequestPtr;
 
 class QKLIBSHARED_EXPORT QkFrame
 {
@@ -144,6 +170,9 @@ public:
         Descriptor()
         {
             board = 0;
+            priority = -1;
+            deadline = 0;
+            dropLate = true;
         }
         uint64_t address;
         uint8_t  code;
@@ -154,25 +183,77 @@ public:
         int getnode_address;
         int setconfig_idx;
         int action_id;
+
+        int priority; // Transmission::Priority, -1 picks it from the code
+        int deadline; // ms
+        bool dropLate;
     };
     class Transmission
     {
     public:
+        // Outgoing lanes, served in this order: a queued ACTUATE never
+        // waits behind configuration or discovery traffic.
+        enum Priority
+        {
+            Control,
+            Configuration,
+            Discovery,
+            Priorities
+        };
         Transmission()
         {
             waitACK = true;
-            timeout = 500;
+            timeout = 0;
             retries = 0;
+            priority = Discovery;
+            deadline = 0;
+            dropLate = true;
+            queuedAt = 0;
+            late = false;
         }
+        static Priority priorityOf(int code);
+
         bool waitACK;
-        int timeout;
+        int timeout; // ms, 0 = adaptive (RTT based)
         int retries;
+        Priority priority;
+        int deadline; // ms after queuing to start sending, 0 = none
+        bool dropLate; // a late packet is dropped, or sent and its ACK flagged
+        qint64 queuedAt;
+        bool late;
+        QkRequestPtr request;
     };
 
+    // Wire layouts, shared by Builder and the packet handlers.
+    typedef QkCodec::Layout<QkCodec::UInt<2>, QkCodec::UInt<1>> Header; // ctrl, code
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<1>> AckLayout; // id, code, result
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>> AckErrorLayout; // err, arg
+    typedef QkCodec::Layout<QkCodec::UInt<4>> GetNodeLayout; // address
+    typedef QkCodec::Layout<QkCodec::String<QK_BOARD_NAME_SIZE>> SetNameLayout; // name
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>> SetConfigLayout; // count, index
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>> ActuateLayout; // id, type
+    typedef QkCodec::Layout<QkCodec::UInt<4>, QkCodec::UInt<1>, QkCodec::UInt<1>,
+                            QkCodec::UInt<1>, QkCodec::UInt<4>> SampLayout; // freq, mode, clock, scaler, N
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<1>,
+                            QkCodec::UInt<4>, QkCodec::UInt<4>> InfoQkLayout; // major, minor, patch, baud, flags
+    typedef QkCodec::Layout<QkCodec::UInt<2>, QkCodec::String<QK_BOARD_NAME_SIZE>> InfoBoardLayout; // fw, name
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>> DataLayout; // count, type; then count 32-bit lanes
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<2>,
+                            QkCodec::UInt<4>, QkCodec::UInt<4>> DataBatchLayout; // count, type, samples, base (ms), interval (us); then samples*count lanes
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<1>,
+                            QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<1>> DateTimeLayout; // yy, mm, dd, h, m, s
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>, QkCodec::UInt<1>> TimeLayout; // h, m, s
+    typedef QkCodec::Layout<QkCodec::UInt<1>> CountLayout; // count
+    typedef QkCodec::Layout<QkCodec::String<QK_LABEL_SIZE>> LabelLayout; // label
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::String<QK_LABEL_SIZE>> TypedLabelLayout; // type, label
+    typedef QkCodec::Layout<QkCodec::SInt<4>, QkCodec::SInt<4>> RangeLayout; // min, max
+    typedef QkCodec::Layout<QkCodec::UInt<1>, QkCodec::UInt<1>> EventLayout; // id, nargs; then nargs floats and a string
+
     class QKLIBSHARED_EXPORT Builder {
     public:
         static bool build(QkPacket *packet, const Descriptor &desc);
         static bool validate(Descriptor *pd);
+        static bool verify(const QkFrame &frame);
         static void parse(const QkFrame &frame, QkPacket *packet);
     };
 
@@ -182,6 +263,8 @@ public:
         flags.ctrl = 0;
         flags.network = 0;
         code = 0;
+        dataOffset = 0;
+        dataLength = 0;
     }
 
     int address;
@@ -190,7 +273,12 @@ public:
      int network;
     } flags;
     int code;
-    QByteArray data;
+    // Received packets share the whole frame here (header and checksum
+    // included); the payload is buffer[dataOffset, dataOffset + dataLength).
+    // Read it through payload(), read<L>() or readString().
+    QByteArray buffer;
+    int dataOffset;
+    int dataLength;
     int checksum;
     int headerLength;
     int id;
@@ -198,15 +286,30 @@ public:
     quint64 timestamp;
     Transmission tx;
 
-    QString codeFriendlyName();
-    int source();
+    const char* payload() const { return buffer.constData() + dataOffset; }
+
+    // Decodes layout L at data[*idx], bounded by the end of the payload.
+    template<typename L, typename... Args>
+    bool read(int *idx, Args*... values) const
+    {
+        return QkCodec::read<L>(buffer.constData(), dataOffset + dataLength, idx, values...);
+    }
+    bool readString(int *idx, QString *value) const
+    {
+        return QkCodec::readString(buffer.constData(), dataOffset + dataLength, idx, value);
+    }
+    QString codeFriendlyName() const;
+    int source() const;
     void calculateHeaderLenght();
     void process(QkCore *qk);
 
-    static int requestId();
-
-private:
-    static int m_nextId;
+    // Checksum byte on the wire: the last byte of a frame (after DLE
+    // unescaping) is the 8-bit XOR of every byte before it, i.e. ctrl,
+    // address (if present), code and payload. No firmware reference vector
+    // exists for it yet, so verification is off by default (enable it per
+    // connection with QkConnection::setVerifyChecksum()) and outgoing
+    // frames do not carry one.
+    static quint8 checksum(const char *data, int count);
 };
 
 Q_DECLARE_METATYPE(QkPacket)
@@ -222,15 +325,22 @@ public:
     };
     QkAck()
     {
+        id = 0;
         result = ACK_NACK;
+        arg = 0;
+        err = 0;
+        code = 0;
+        late = false;
     }
 
     static QkAck fromInt(int ack);
+    bool decode(const QkPacket &packet);
     int id;
     int result;
     int arg;
     int err;
     int code;
+    bool late; // missed its deadline: never sent (err timeout) or sent late
     int toInt();
     bool operator ==(const QkAck &other)
     {
@@ -238,29 +348,161 @@ public:
     }
 };
 
-class QkProtocolWorker : public QObject
+Q_DECLARE_METATYPE(QkAck)
+
+class QKLIBSHARED_EXPORT QkRequest : public QObject
+{
+    Q_OBJECT
+    friend class QkProtocolWorker;
+    friend class QkProtocol;
+public:
+    QkRequest(int id, int code, QObject *parent = 0);
+
+    int id(); // -1 until the request is sent
+    int code() { return m_code; }
+    bool isFinished();
+    QkAck ack();
+    // timeout < 0 waits as long as the worker may keep retrying, see
+    // maxWait(); an unfinished request then reads as QK_ERR_COMM_TIMEOUT
+    QkAck waitForFinished(int timeout = -1);
+    int maxWait() { return m_maxWait; }
+
+signals:
+    void finished(QkAck ack);
+
+private slots:
+    void emitFinished();
+
+private:
+    void finish(const QkAck &ack);
+    void _setId(int id);
+    void _setMaxWait(int timeout, int retries);
+
+    int m_id;
+    int m_code;
+    int m_maxWait;
+    bool m_finished;
+    QkAck m_ack;
+    QMutex m_mutex;
+};
+
+class QkRttEstimator
+{
+public:
+    enum
+    {
+        InitialRto = 500,
+        MinRto = 20,
+        MaxRto = 3000
+    };
+
+    QkRttEstimator();
+
+    void addSample(int rtt);
+    int rto() { return m_rto; }
+    int samples() { return m_samples; }
+    qreal srtt() { return m_srtt; }
+
+private:
+    qreal m_srtt;
+    qreal m_rttvar;
+    int m_rto;
+    int m_samples;
+};
+
+class QkProtocolWorker : public QObject, public QkReactor::Source
 {
     Q_OBJECT
 public:
     QkProtocolWorker(QObject *parent = 0);
 
+    void setWindowSize(int size);
+    int windowSize() { return m_windowSize; }
+    int rto(int address = -1);
+    // off by default, see QkPacket::checksum()
+    void setVerifyChecksum(bool enabled) { m_verifyChecksum.store(enabled ? 1 : 0); }
+    bool verifyChecksum() { return m_verifyChecksum.load() != 0; }
+    int checksumErrors() { return m_checksumErrors.load(); }
+    int malformedFrames() { return m_malformedFrames.load(); }
+    int droppedFragments() { return m_droppedFragments.load(); }
+    int inputQueueHighWater() { return m_rxRing.highWater(); }
+    int inputQueueOverflows() { return m_rxRing.overflows(); }
+    int outputQueueHighWater() { return m_outputHighWater.load(); }
+    int latePackets() { return m_latePackets.load(); }
+
+    // driven by a QkReactor instead of run()
+    bool attach();
+    void detach();
+    int service();
+
 signals:
     void finished();
-    void frameReady(QkFrame);
-    void packetReady(QkPacket);
+    void frameReady(const QkFrame &frame);
+    void packetReady(const QkPacket &packet);
+    void ackReceived(const QkPacket &packet, const QkAck &ack);
 
 public slots:
     void run();
     void quit();
-    void sendPacket(QkPacket packet);
-    void parseFrame(QkFrame frame);
+    void sendPacket(const QkPacket &packet);
+    void receiveFrame(const QkFrame &frame);
 
 private:
-    QkAck waitForACK(int packetId, int timeout = 500);
-    void processPacket(QkPacket packet);
-    QkPacketQueue m_outputPacketsQueue;
-    QList<QkAck> m_acks;
+    class Pending
+    {
+    public:
+        int code;
+        int address;
+        QByteArray frame;
+        qint64 sentAt;
+        int timeout;
+        bool adaptive;
+        int retries;
+        int transmissions;
+        bool late;
+        QkRequestPtr request;
+    };
+
+    class Fragment
+    {
+    public:
+        QByteArray data;
+        qint64 timestamp;
+        bool active;
+    };
+
+    void receivePending();
+    void parseFrame(const QkFrame &frame);
+    bool reassemble(QkPacket *packet);
+    bool nextPacket(QkPacket *packet);
+    void finishUnsent(const QkPacket &packet, int err, bool late = false);
+    bool completeAck(const QkPacket &packet, QkAck *ack);
+    int transmit();
+    void abortAll();
+    void wakeUp();
+    int expirePending();
+    void failPending(int id, int err = QK_ERR_COMM_TIMEOUT);
+    int freeId();
+    QkRttEstimator *rttEstimator(int address);
+    QkPacketQueue m_outputQueues[QkPacket::Transmission::Priorities]; // any thread may send, so they stay locked
+    QkFrameQueue m_retransmitQueue;
+    QkRing<QkFrame> m_rxRing; // from the link worker, whose thread is the only producer
+    Pending m_pending[QkTimerWheel::Capacity];
+    QkTimerWheel m_timers;
+    QkRttEstimator m_rtt;
+    QHash<int, QkRttEstimator> m_nodeRtt;
+    QHash<int, Fragment> m_fragments;
+    QElapsedTimer m_clock;
+    int m_windowSize;
+    int m_nextId;
     bool m_quit;
+    QAtomicInt m_verifyChecksum; // set from any thread
+    QAtomicInt m_checksumErrors;
+    QAtomicInt m_malformedFrames;
+    QAtomicInt m_droppedFragments;
+    QAtomicInt m_outputHighWater;
+    QAtomicInt m_latePackets;
+    QAtomicInt m_sleeping;
 
     QMutex m_mutex;
     QWaitCondition m_condition;
@@ -280,10 +522,38 @@ public:
 
     QkAck sendPacket(QkPacket::Descriptor descriptor,
                      bool wait = true,
-                     int timeout = 2000,
-                     int retries = 0);
+                     int timeout = 0,
+                     int retries = 2);
+    QkRequestPtr sendPacketAsync(QkPacket::Descriptor descriptor,
+                                 int timeout = 0,
+                                 int retries = 2);
+
+    void setWindowSize(int size) { m_protocolWorker->setWindowSize(size); }
+    // drop (and count) frames whose checksum byte is wrong; off by default,
+    // see QkPacket::checksum()
+    void setVerifyChecksum(bool enabled) { m_protocolWorker->setVerifyChecksum(enabled); }
+    bool verifyChecksum() { return m_protocolWorker->verifyChecksum(); }
 
     QkProtocolWorker *worker() { return m_protocolWorker; }
+    void _stopWorkerThread();
+
+    // takes ownership, replacing (and deleting) the handler for that code;
+    // the ACK handler is only given discovery ACKs, see processAck()
+    void registerHandler(int code, QkPacketHandler *handler);
+    QkPacketHandler* handler(int code) { return m_handlers[code & 0xFF]; }
+
+    QkBoard* board(const QkPacket &packet);
+    QkDevice* device(const QkPacket &packet);
+
+    // dataReceived() carries a labelled copy of every channel, so it is
+    // only built while something is connected to it
+    bool isDataReceivedConnected() const;
+
+    // the subscription keeps its own thread; see QkSubscription
+    void subscribe(QkSubscription *subscription);
+    void unsubscribe(QkSubscription *subscription);
+    void _publishData(int address, const float *values, int channels, int samples,
+                      quint64 timestamp, int interval = 0);
 
 signals:
     //void outputFrameReady(QkFrameQueue*);
@@ -293,29 +563,33 @@ signals:
     void deviceFound(int address);
     void deviceUpdated(int address);
     void dataReceived(int address, QkDevice::DataArray data);
+    void dataUpdated(int address, quint64 timestamp);
     void eventReceived(int address, QkDevice::Event event);
     void debugReceived(int address, QString str);
-    void packetReady(QkPacket);
+    void packetReady(const QkPacket &packet);
     void packetProcessed();
+    void ready();
     void ack(QkAck ack);
     void error(int errCode, int errArg);
 
 public slots:
     //void processFrame(const QkFrame &frame);
-    void processPacket(QkPacket packet);
+    void processPacket(const QkPacket &packet);
+    void processAck(const QkPacket &packet, const QkAck &ack);
 
 
 
 private:
     void setupSignals();
-    QkAck waitForACK(int packetId, int timeout = 500);
     //QkAck waitForACK(int timeout = 2000);
 
     QkCore *m_qk;
-    QList<QkAck> m_acks;
 
     QThread *m_workerThread;
     QkProtocolWorker *m_protocolWorker;
+    QkPacketHandler *m_handlers[256];
+    QMultiHash<int, QkSubscription*> m_subscriptions;
+    QMutex m_subscriptionsMutex;
 //    QkFrameQueue m_outputFramesQueue;
 //    QReadWriteLock m_outputFramesLock;
 };
@@ -0,0 +1,353 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qkreactor.h"
+
+#include <QDebug>
+#include <QThread>
+
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+QkReactor::QkReactor(QObject *parent) :
+    QObject(parent)
+{
+    m_epoll = -1;
+    m_event = -1;
+    m_running = false;
+    m_quit = false;
+
+#ifdef Q_OS_LINUX
+    // Created up front and kept until destruction, so wakeUp() never races
+    // with the loop starting or stopping.
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epoll >= 0 && m_event >= 0)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = 0;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_event, &event);
+    }
+#endif
+}
+
+QkReactor::~QkReactor()
+{
+    qDeleteAll(m_entries);
+#ifdef Q_OS_LINUX
+    if(m_event >= 0)
+        ::close(m_event);
+    if(m_epoll >= 0)
+        ::close(m_epoll);
+#endif
+}
+
+void QkReactor::add(Source *source)
+{
+    QMutexLocker locker(&m_mutex);
+    source->_setReactor(this);
+    m_additions.append(source);
+    wakeUp();
+}
+
+// Detaches the source before returning, so it can be deleted right after
+// (unless called from the reactor thread itself).
+void QkReactor::remove(Source *source)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if(m_additions.removeOne(source))
+    {
+        source->_setReactor(0);
+        return;
+    }
+
+    Entry *e = entry(source);
+    if(e == 0 && !m_attaching.contains(source))
+        return;
+
+    if(!m_running && e != 0)
+    {
+        m_entries.removeOne(e);
+        locker.unlock();
+        detach(e);
+        delete e;
+        return;
+    }
+
+    m_removals.append(source);
+    wakeUp();
+    if(QThread::currentThread() == thread())
+        return; // from a source callback: detached before the next wait
+    while(m_attaching.contains(source) || entry(source) != 0)
+        m_changed.wait(&m_mutex);
+}
+
+int QkReactor::count()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_entries.count() + m_attaching.count() + m_additions.count();
+}
+
+void QkReactor::wakeUp(Source *source)
+{
+    source->m_wake.storeRelease(1);
+    // the loop checks the flags before it sleeps again
+    if(QThread::currentThread() != thread())
+        wakeUp();
+}
+
+void QkReactor::wakeUp()
+{
+#ifdef Q_OS_LINUX
+    if(m_event >= 0)
+    {
+        quint64 one = 1;
+        if(::write(m_event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            qWarning() << __FUNCTION__ << "eventfd write failed";
+    }
+#endif
+}
+
+void QkReactor::quit()
+{
+    QMutexLocker locker(&m_mutex);
+    m_quit = true;
+    wakeUp();
+}
+
+QkReactor::Entry* QkReactor::entry(Source *source)
+{
+    // Called with m_mutex held, or on the reactor thread.
+    foreach(Entry *e, m_entries)
+        if(e->source == source)
+            return e;
+    return 0;
+}
+
+QkReactor::Entry* QkReactor::attach(Source *source)
+{
+    // Called on the reactor thread, without m_mutex.
+    if(!source->attach())
+    {
+        source->_setReactor(0);
+        return 0;
+    }
+
+    Entry *entry = new Entry;
+    entry->source = source;
+    entry->fd = source->descriptor();
+    entry->writing = false;
+    entry->deadline = 0;
+    source->m_wake.storeRelease(1);
+
+#ifdef Q_OS_LINUX
+    if(entry->fd >= 0)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = entry;
+        if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, entry->fd, &event) < 0)
+        {
+            qWarning() << __FUNCTION__ << "epoll_ctl failed for descriptor" << entry->fd;
+            entry->fd = -1;
+        }
+    }
+#endif
+    return entry;
+}
+
+void QkReactor::detach(Entry *entry)
+{
+    // Called without m_mutex; the caller deletes the entry once it is out
+    // of m_entries.
+#ifdef Q_OS_LINUX
+    if(entry->fd >= 0 && m_epoll >= 0)
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, entry->fd, 0);
+#endif
+    entry->fd = -1;
+    entry->source->detach();
+    entry->source->_setReactor(0);
+}
+
+void QkReactor::processChanges()
+{
+    // On the reactor thread. The attach() and detach() callbacks run
+    // unlocked; remove() keeps waiting while its source is in m_attaching
+    // or m_entries, so nothing is deleted under them.
+    QMutexLocker locker(&m_mutex);
+    if(m_additions.isEmpty() && m_removals.isEmpty())
+        return;
+
+    QList<Entry*> leaving;
+    foreach(Source *source, m_removals)
+    {
+        Entry *e = entry(source);
+        if(e != 0 && !leaving.contains(e))
+            leaving.append(e);
+    }
+    m_removals.clear();
+    m_attaching.swap(m_additions);
+    const QList<Source*> additions = m_attaching;
+    locker.unlock();
+
+    QList<Entry*> joining;
+    foreach(Entry *e, leaving)
+        detach(e);
+    foreach(Source *source, additions)
+    {
+        Entry *e = attach(source);
+        if(e != 0)
+            joining.append(e);
+    }
+
+    locker.relock();
+    foreach(Entry *e, leaving)
+    {
+        m_entries.removeOne(e);
+        delete e;
+    }
+    m_entries.append(joining);
+    m_attaching.clear();
+    m_changed.wakeAll();
+}
+
+int QkReactor::serviceSources()
+{
+    // On the reactor thread, without m_mutex. Returns the epoll timeout.
+    qint64 now = m_clock.elapsed();
+    bool again = false;
+
+    foreach(Entry *entry, m_entries)
+    {
+        Source *source = entry->source;
+        if(source->m_wake.fetchAndStoreAcquire(0) == 0 &&
+           (entry->deadline < 0 || entry->deadline > now))
+            continue;
+
+        int next = source->service();
+        now = m_clock.elapsed();
+        entry->deadline = (next < 0 ? -1 : now + next);
+
+#ifdef Q_OS_LINUX
+        bool writing = source->wantsWrite();
+        if(entry->fd >= 0 && writing != entry->writing)
+        {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+            event.data.ptr = entry;
+            epoll_ctl(m_epoll, EPOLL_CTL_MOD, entry->fd, &event);
+            entry->writing = writing;
+        }
+#endif
+    }
+
+    qint64 timeout = -1;
+    foreach(Entry *entry, m_entries)
+    {
+        // a source serviced early may have woken one serviced before it
+        if(entry->source->m_wake.loadAcquire() != 0)
+            again = true;
+        if(entry->deadline >= 0 && (timeout < 0 || entry->deadline - now < timeout))
+            timeout = qMax((qint64) 0, entry->deadline - now);
+    }
+    // add() and remove() write the eventfd, so pending changes cut the
+    // wait short on their own
+    if(again)
+        return 0;
+    return (int) timeout;
+}
+
+void QkReactor::run()
+{
+#ifdef Q_OS_LINUX
+    if(m_epoll < 0 || m_event < 0)
+    {
+        emit error(tr("Failed to create the reactor"));
+        emit finished();
+        return;
+    }
+
+    struct epoll_event events[MaxEvents];
+    m_clock.start();
+
+    m_mutex.lock();
+    m_running = true;
+    m_mutex.unlock();
+    forever
+    {
+        m_mutex.lock();
+        const bool quit = m_quit;
+        m_mutex.unlock();
+        if(quit)
+            break;
+
+        processChanges();
+        int timeout = serviceSources();
+        int count = epoll_wait(m_epoll, events, MaxEvents, timeout);
+
+        for(int i = 0; i < count; i++)
+        {
+            Entry *entry = (Entry*) events[i].data.ptr;
+            if(entry == 0)
+            {
+                quint64 value;
+                while(::read(m_event, &value, sizeof(value)) > 0)
+                    ;
+                continue;
+            }
+            // entries are only deleted by processChanges(), never in here
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+                entry->source->readable();
+            if(events[i].events & EPOLLOUT)
+                entry->source->m_wake.storeRelease(1);
+            if(events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+            {
+                qWarning() << __FUNCTION__ << "descriptor closed" << entry->fd;
+                // stop polling it now, the source decides how to go away
+                epoll_ctl(m_epoll, EPOLL_CTL_DEL, entry->fd, 0);
+                entry->fd = -1;
+                entry->source->hangUp();
+            }
+        }
+    }
+
+    foreach(Entry *entry, m_entries)
+        detach(entry);
+
+    m_mutex.lock();
+    qDeleteAll(m_entries);
+    m_entries.clear();
+    foreach(Source *source, m_additions)
+        source->_setReactor(0);
+    m_additions.clear();
+    m_removals.clear();
+    m_running = false;
+    m_changed.wakeAll();
+    m_mutex.unlock();
+#else
+    emit error(tr("The reactor needs epoll (Linux)"));
+#endif
+    emit finished();
+}
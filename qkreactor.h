@@ -0,0 +1,126 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKREACTOR_H
+#define QKREACTOR_H
+
+#include "qkcore_lib.h"
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+
+/**
+ * One thread servicing many links. Every connection worker and protocol
+ * worker attached to a reactor is driven from its loop instead of from a
+ * thread of its own: descriptors are multiplexed with epoll and a source is
+ * only serviced when it asked for it (wakeUp()) or its deadline is due, so
+ * the cost of a wakeup does not grow with the number of idle links.
+ *
+ * The source callbacks run on the reactor thread without any reactor lock
+ * held, so they may add, remove and wake sources themselves.
+ *
+ * Only available on Linux; elsewhere run() reports an error and returns.
+ */
+class QKLIBSHARED_EXPORT QkReactor : public QObject
+{
+    Q_OBJECT
+public:
+    class Source
+    {
+    public:
+        Source() : m_reactor(0) {}
+        virtual ~Source() {}
+
+        // called on the reactor thread
+        virtual int descriptor() { return -1; }
+        virtual bool attach() { return true; }
+        virtual void detach() {}
+        virtual void readable() {}
+        virtual bool wantsWrite() { return false; }
+        virtual int service() = 0; // ms until it must run again, -1 if idle
+        virtual void hangUp() { m_reactor->remove(this); } // descriptor closed
+
+        QkReactor* reactor() { return m_reactor; }
+        void _setReactor(QkReactor *reactor) { m_reactor = reactor; }
+
+    private:
+        friend class QkReactor;
+        QkReactor *m_reactor;
+        QAtomicInt m_wake;
+    };
+
+    enum
+    {
+        MaxEvents = 64
+    };
+
+    QkReactor(QObject *parent = 0);
+    ~QkReactor();
+
+    void add(Source *source);
+    void remove(Source *source);
+    int count();
+
+    void wakeUp(Source *source);
+
+signals:
+    void finished();
+    void error(QString message);
+
+public slots:
+    void run();
+    void quit();
+
+private:
+    class Entry
+    {
+    public:
+        Source *source;
+        int fd;
+        bool writing;
+        qint64 deadline;
+    };
+
+    void wakeUp();
+    void processChanges();
+    Entry* attach(Source *source);
+    void detach(Entry *entry);
+    Entry* entry(Source *source);
+    int serviceSources();
+
+    // m_entries is only changed by the reactor thread, with m_mutex held
+    QList<Entry*> m_entries;
+    QList<Source*> m_additions;
+    QList<Source*> m_removals;
+    QList<Source*> m_attaching;
+    QElapsedTimer m_clock;
+    int m_epoll;
+    int m_event;
+    bool m_running;
+    bool m_quit;
+
+    QMutex m_mutex;
+    QWaitCondition m_changed;
+};
+
+#endif // QKREACTOR_H
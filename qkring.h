@@ -0,0 +1,119 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKRING_H
+#define QKRING_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QAtomicInt>
+
+/**
+ * Bounded single-producer/single-consumer ring. The slots are allocated
+ * once and reused; neither side ever locks or waits. The producer fills a
+ * slot in place with next()/push() and the consumer reads it in place with
+ * front()/pop(). A full ring refuses the item and counts the overflow.
+ */
+template<typename T>
+class QkRing
+{
+public:
+    enum
+    {
+        DefaultCapacity = 256
+    };
+
+    QkRing(int capacity = DefaultCapacity) { setCapacity(capacity); }
+
+    // Rounds up to a power of two. Not thread safe: call before use.
+    void setCapacity(int capacity)
+    {
+        int size = 1;
+        while(size < capacity)
+            size <<= 1;
+        m_slots = QVector<T>(size);
+        m_buffer = m_slots.data();
+        m_mask = size - 1;
+        m_head.store(0);
+        m_tail.store(0);
+    }
+    int capacity() const { return m_mask + 1; }
+
+    // For preallocating the slots' contents before use.
+    T& slot(int index) { return m_buffer[index & m_mask]; }
+
+    // producer side
+    T* next()
+    {
+        const quint32 head = m_head.load();
+        if(head - (quint32) m_tail.loadAcquire() > (quint32) m_mask)
+        {
+            m_overflows.ref();
+            return 0;
+        }
+        return &m_buffer[head & m_mask];
+    }
+    void push()
+    {
+        const quint32 head = (quint32) m_head.load() + 1;
+        m_head.storeRelease((int) head);
+        const int count = (int) (head - (quint32) m_tail.loadAcquire());
+        if(count > m_highWater.load())
+            m_highWater.store(count);
+    }
+    bool put(const T &item)
+    {
+        T *slot = next();
+        if(slot == 0)
+            return false;
+        *slot = item;
+        push();
+        return true;
+    }
+
+    // consumer side
+    T* front()
+    {
+        const quint32 tail = m_tail.load();
+        if((quint32) m_head.loadAcquire() == tail)
+            return 0;
+        return &m_buffer[tail & m_mask];
+    }
+    void pop()
+    {
+        m_tail.storeRelease((int) ((quint32) m_tail.load() + 1));
+    }
+
+    int count() const { return (int) ((quint32) m_head.loadAcquire() - (quint32) m_tail.loadAcquire()); }
+    bool isEmpty() const { return count() == 0; }
+
+    int highWater() const { return m_highWater.load(); }
+    int overflows() const { return m_overflows.load(); }
+
+private:
+    QVector<T> m_slots;
+    T *m_buffer;
+    int m_mask;
+    QAtomicInt m_head; // written by the producer only
+    QAtomicInt m_tail; // written by the consumer only
+    QAtomicInt m_highWater;
+    QAtomicInt m_overflows;
+};
+
+#endif // QKRING_H
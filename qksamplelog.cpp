@@ -0,0 +1,221 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qksamplelog.h"
+
+#include <string.h>
+
+QkSampleLog::QkSampleLog(int capacity)
+{
+    m_channels = 0;
+    m_capacity = (capacity > 0 ? capacity : 1);
+    m_head = 0;
+    m_count = 0;
+    m_written = 0;
+}
+
+void QkSampleLog::setChannels(int channels)
+{
+    if(channels == m_channels)
+        return;
+    m_channels = channels;
+    allocate();
+}
+
+void QkSampleLog::setCapacity(int capacity)
+{
+    if(capacity <= 0 || capacity == m_capacity)
+        return;
+    m_capacity = capacity;
+    allocate();
+}
+
+void QkSampleLog::clear()
+{
+    m_sequence.beginWrite();
+    m_head = 0;
+    m_count = 0;
+    m_written = 0;
+    m_sequence.endWrite();
+}
+
+void QkSampleLog::allocate()
+{
+    m_values = QVector<float>(m_channels * m_capacity);
+    m_timestamps = QVector<quint64>(m_channels > 0 ? m_capacity : 0);
+    clear();
+}
+
+void QkSampleLog::append(const float *values, quint64 timestamp)
+{
+    // The slot is overwritten inside the write section: a snapshot that
+    // copied any of the new values is bound to see m_written move on and
+    // drop that slot, whatever order the stores become visible in.
+    m_sequence.beginWrite();
+    float *column = m_values.data() + m_head;
+    for(int c = 0; c < m_channels; c++)
+        column[c*m_capacity] = values[c];
+    m_timestamps.data()[m_head] = timestamp;
+
+    if(++m_head == m_capacity)
+        m_head = 0;
+    if(m_count < m_capacity)
+        m_count++;
+    m_written++;
+    m_sequence.endWrite();
+}
+
+void QkSampleLog::positions(int *head, int *count, quint32 *written) const
+{
+    int sequence;
+    do
+    {
+        sequence = m_sequence.readBegin();
+        *head = m_head;
+        *count = m_count;
+        *written = m_written;
+    } while(m_sequence.readRetry(sequence));
+}
+
+// Copies the newest (up to) last samples of channel, oldest first, while the
+// writer keeps appending. Samples overwritten during the copy are dropped
+// from the front; returns how many are left.
+int QkSampleLog::snapshot(int channel, int last, float *values, quint64 *timestamps) const
+{
+    if(channel < 0 || channel >= m_channels)
+        return 0;
+    return snapshotColumns(channel, 1, last, values, timestamps);
+}
+
+// As above for every channel at once, so all columns cover the same
+// samples: column c goes to values[c*last, (c+1)*last).
+int QkSampleLog::snapshot(int last, float *values, quint64 *timestamps) const
+{
+    return snapshotColumns(0, m_channels, last, values, timestamps);
+}
+
+int QkSampleLog::snapshotColumns(int firstChannel, int channels, int last, float *values, quint64 *timestamps) const
+{
+    if(channels <= 0 || last <= 0)
+        return 0;
+
+    int head, count, head2, count2;
+    quint32 written, written2;
+    positions(&head, &count, &written);
+
+    const int n = qMin(last, count);
+    int pos = head - n;
+    if(pos < 0)
+        pos += m_capacity;
+    const int first = qMin(n, m_capacity - pos);
+
+    for(int c = 0; c < channels; c++)
+    {
+        const float *column = this->column(firstChannel + c);
+        float *dst = values + c*last;
+        memcpy(dst, column + pos, first * sizeof(float));
+        memcpy(dst + first, column, (n - first) * sizeof(float));
+    }
+    if(timestamps != 0)
+    {
+        memcpy(timestamps, m_timestamps.constData() + pos, first * sizeof(quint64));
+        memcpy(timestamps + first, m_timestamps.constData(), (n - first) * sizeof(quint64));
+    }
+
+    // sample s is intact while fewer than capacity samples followed it
+    std::atomic_thread_fence(std::memory_order_acquire);
+    positions(&head2, &count2, &written2);
+    const quint32 age = written2 - (written - n);
+    int lost = (age >= (quint32) m_capacity ? (int) qMin<quint32>(age - m_capacity + 1, n) : 0);
+    if(lost > 0)
+    {
+        for(int c = 0; c < channels; c++)
+            memmove(values + c*last, values + c*last + lost, (n - lost) * sizeof(float));
+        if(timestamps != 0)
+            memmove(timestamps, timestamps + lost, (n - lost) * sizeof(quint64));
+    }
+    return n - lost;
+}
+
+int QkSampleLog::position(int index) const
+{
+    int pos = m_head - m_count + index;
+    if(pos < 0)
+        pos += m_capacity;
+    return pos;
+}
+
+float QkSampleLog::value(int channel, int index) const
+{
+    return m_values.at(channel*m_capacity + position(index));
+}
+
+quint64 QkSampleLog::timestamp(int index) const
+{
+    return m_timestamps.at(position(index));
+}
+
+// Raw ring storage of a channel (capacity() floats, not in time order).
+const float* QkSampleLog::column(int channel) const
+{
+    return m_values.constData() + channel*m_capacity;
+}
+
+int QkSampleLog::copy(int channel, int first, int count, float *dst) const
+{
+    if(channel < 0 || channel >= m_channels || first < 0 || first >= m_count)
+        return 0;
+    count = qMin(count, m_count - first);
+
+    const float *src = column(channel);
+    const int pos = position(first);
+    const int head = qMin(count, m_capacity - pos);
+    memcpy(dst, src + pos, head * sizeof(float));
+    memcpy(dst + head, src, (count - head) * sizeof(float));
+    return count;
+}
+
+int QkSampleLog::copyTimestamps(int first, int count, quint64 *dst) const
+{
+    if(first < 0 || first >= m_count)
+        return 0;
+    count = qMin(count, m_count - first);
+
+    const quint64 *src = m_timestamps.constData();
+    const int pos = position(first);
+    const int head = qMin(count, m_capacity - pos);
+    memcpy(dst, src + pos, head * sizeof(quint64));
+    memcpy(dst + head, src, (count - head) * sizeof(quint64));
+    return count;
+}
+
+// Index of the first sample taken at or after timestamp (count() if none).
+int QkSampleLog::indexOf(quint64 timestamp) const
+{
+    int lo = 0, hi = m_count;
+    while(lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if(this->timestamp(mid) < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -0,0 +1,86 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKSAMPLELOG_H
+#define QKSAMPLELOG_H
+
+#include "qkcore_lib.h"
+#include "qkseqlock.h"
+
+#include <QtGlobal>
+#include <QVector>
+
+/**
+ * Fixed-capacity columnar ring of samples: one contiguous float column per
+ * channel plus one timestamp column. Appending a sample is a store per
+ * channel; once full, the oldest sample is overwritten.
+ * Index 0 is the oldest sample held, count()-1 the newest.
+ *
+ * One thread appends. snapshot() may be called from any other thread at
+ * the same time; the remaining accessors belong to the writer's thread.
+ * Changing channels or capacity reallocates and must be serialized with
+ * readers by the owner.
+ */
+class QKLIBSHARED_EXPORT QkSampleLog
+{
+public:
+    enum
+    {
+        DefaultCapacity = 1024 // samples per channel, see QkDevice::setDataLogCapacity()
+    };
+
+    QkSampleLog(int capacity = DefaultCapacity);
+
+    void setChannels(int channels);
+    void setCapacity(int capacity);
+    void clear();
+
+    int channels() const { return m_channels; }
+    int capacity() const { return m_capacity; }
+    int count() const { return m_count; }
+
+    void append(const float *values, quint64 timestamp);
+
+    float value(int channel, int index) const;
+    quint64 timestamp(int index) const;
+    const float* column(int channel) const;
+    int copy(int channel, int first, int count, float *dst) const;
+    int copyTimestamps(int first, int count, quint64 *dst) const;
+    int indexOf(quint64 timestamp) const;
+
+    int snapshot(int channel, int last, float *values, quint64 *timestamps = 0) const;
+    int snapshot(int last, float *values, quint64 *timestamps = 0) const;
+
+private:
+    int snapshotColumns(int firstChannel, int channels, int last, float *values, quint64 *timestamps) const;
+    void allocate();
+    int position(int index) const;
+    void positions(int *head, int *count, quint32 *written) const;
+
+    QVector<float> m_values; // column c is m_values[c*m_capacity, (c+1)*m_capacity)
+    QVector<quint64> m_timestamps;
+    int m_channels;
+    int m_capacity;
+    int m_head;
+    int m_count;
+    quint32 m_written; // samples appended since clear(), wrapping
+    QkSeqLock m_sequence;
+};
+
+#endif // QKSAMPLELOG_H
@@ -0,0 +1,90 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKSEQLOCK_H
+#define QKSEQLOCK_H
+
+#include <QAtomicInt>
+#include <QThread>
+
+#include <atomic>
+
+/**
+ * Sequence lock for one writer and any number of readers. The writer never
+ * waits; readers copy the protected plain data and retry if a write
+ * overlapped the copy.
+ *
+ *   do {
+ *       sequence = lock.readBegin();
+ *       ...copy...
+ *   } while(lock.readRetry(sequence));
+ */
+class QkSeqLock
+{
+public:
+    void beginWrite()
+    {
+        m_sequence.store(m_sequence.load() + 1);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void endWrite()
+    {
+        m_sequence.storeRelease(m_sequence.load() + 1);
+    }
+
+    int readBegin() const
+    {
+        int sequence;
+        while((sequence = m_sequence.loadAcquire()) & 1)
+            ;
+        return sequence;
+    }
+    bool readRetry(int sequence) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return m_sequence.load() != sequence;
+    }
+
+private:
+    QAtomicInt m_sequence;
+};
+
+/**
+ * Minimal spin lock for handing implicitly shared containers between
+ * threads: the critical sections are a reference count bump or a short
+ * append, never I/O or a wait.
+ */
+class QkSpinLock
+{
+public:
+    void lock()
+    {
+        while(!m_locked.testAndSetAcquire(0, 1))
+            QThread::yieldCurrentThread();
+    }
+    void unlock()
+    {
+        m_locked.storeRelease(0);
+    }
+
+private:
+    QAtomicInt m_locked;
+};
+
+#endif // QKSEQLOCK_H
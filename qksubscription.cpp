@@ -0,0 +1,182 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qksubscription.h"
+#include "qkprotocol.h"
+
+#include <QDebug>
+
+#include <string.h>
+
+QkSubscription::QkSubscription(int address, QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<QkDataBatch>();
+
+    m_protocol = 0;
+    m_address = address;
+    m_mode = EverySample;
+    m_batchSize = 0;
+    m_batchInterval = 0;
+    m_rate = 0;
+    m_maxPending = DefaultMaxPending;
+
+    m_pending.address = address;
+    m_scheduled = false;
+    m_pendingSince = 0;
+    m_lastDelivery = -1;
+    m_clock.start();
+
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+QkSubscription::~QkSubscription()
+{
+    if(m_protocol != 0)
+        m_protocol->unsubscribe(this);
+}
+
+// Called on the protocol thread. values holds samples x channels floats,
+// sample by sample; sample k was taken at timestamp + k*interval us.
+void QkSubscription::_push(const float *values, int channels, int samples, quint64 timestamp, int interval)
+{
+    if(samples <= 0 || channels <= 0)
+        return;
+
+    m_lock.lock();
+    if(m_pending.channels != channels || m_mode == Latest)
+    {
+        m_pending.channels = channels;
+        m_pending.count = 0;
+        m_pending.timestamps.resize(0);
+        m_pending.values.resize(0);
+    }
+    int first = 0;
+    if(m_mode == Latest)
+        first = samples - 1;
+    else if(m_pending.count == 0 && m_batchSize > 0)
+    {
+        m_pending.timestamps.reserve(m_batchSize);
+        m_pending.values.reserve(m_batchSize * channels);
+    }
+
+    const int offset = m_pending.values.size();
+    m_pending.values.resize(offset + (samples - first) * channels);
+    memcpy(m_pending.values.data() + offset, values + first*channels,
+           (samples - first) * channels * sizeof(float));
+    for(int k = first; k < samples; k++)
+        m_pending.timestamps.append(timestamp + ((qint64) k * interval) / 1000);
+    const int before = m_pending.count;
+    m_pending.count += samples - first;
+
+    // A consumer that stopped keeping up loses the oldest samples, half
+    // the cap at a time so the cost stays amortized.
+    const int cap = qMax(m_maxPending, 2*m_batchSize);
+    if(cap > 0 && m_pending.count > cap)
+    {
+        const int dropped = m_pending.count - cap/2;
+        m_pending.values.remove(0, dropped * channels);
+        m_pending.timestamps.remove(0, dropped);
+        m_pending.count -= dropped;
+        m_droppedSamples.fetchAndAddRelaxed(dropped);
+    }
+
+    bool post = false;
+    if(!m_scheduled)
+    {
+        m_scheduled = true;
+        m_pendingSince = m_clock.elapsed();
+        post = true;
+    }
+    else if(m_mode == Batch && m_batchSize > 0 &&
+            before < m_batchSize && m_pending.count >= m_batchSize)
+        post = true;
+    m_lock.unlock();
+
+    if(post)
+        QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+// ms until the pending samples are due, 0 if now, -1 if they wait for more
+int QkSubscription::pendingDelay()
+{
+    const qint64 now = m_clock.elapsed();
+    qint64 due = now;
+
+    m_lock.lock();
+    switch(m_mode)
+    {
+    case EverySample:
+        break;
+    case Batch:
+        if(m_batchSize > 0 && m_pending.count >= m_batchSize)
+            break;
+        if(m_batchInterval > 0)
+            due = m_pendingSince + m_batchInterval;
+        else if(m_batchSize > 0)
+            due = -1;
+        break;
+    case Latest:
+        if(m_rate > 0 && m_lastDelivery >= 0)
+            due = m_lastDelivery + 1000 / m_rate;
+        break;
+    }
+    m_lock.unlock();
+
+    if(due < 0)
+        return -1;
+    return due > now ? (int) (due - now) : 0;
+}
+
+void QkSubscription::deliver()
+{
+    int delay = pendingDelay();
+    if(delay < 0)
+        return;
+    if(delay > 0)
+    {
+        if(!m_timer.isActive())
+            m_timer.start(delay);
+        return;
+    }
+    flush();
+}
+
+void QkSubscription::flush()
+{
+    m_timer.stop();
+
+    m_lock.lock();
+    if(m_pending.count == 0)
+    {
+        m_scheduled = false;
+        m_lock.unlock();
+        return;
+    }
+    QkDataBatch batch = m_pending;
+    m_pending.count = 0;
+    m_pending.timestamps = QVector<quint64>();
+    m_pending.values = QVector<float>();
+    m_scheduled = false;
+    m_lastDelivery = m_clock.elapsed();
+    m_lock.unlock();
+
+    emit dataReceived(batch);
+}
@@ -0,0 +1,135 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKSUBSCRIPTION_H
+#define QKSUBSCRIPTION_H
+
+#include "qkcore_lib.h"
+#include "qkseqlock.h"
+
+#include <QObject>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMetaType>
+#include <QAtomicInt>
+
+class QkProtocol;
+
+/**
+ * Samples of one device delivered together: count samples of channels
+ * values each, stored sample by sample.
+ */
+class QKLIBSHARED_EXPORT QkDataBatch
+{
+public:
+    QkDataBatch() : address(0), channels(0), count(0) {}
+    float value(int sample, int channel) const { return values[sample*channels + channel]; }
+
+    int address;
+    int channels;
+    int count;
+    QVector<quint64> timestamps;
+    QVector<float> values;
+};
+
+Q_DECLARE_METATYPE(QkDataBatch)
+
+/**
+ * Per-consumer feed of one device's samples. The protocol thread only appends to
+ * the subscription and posts at most one event while a delivery is pending,
+ * so a slow consumer gets larger batches instead of a growing event queue.
+ *
+ * - EverySample: every sample, in as few deliveries as the consumer keeps
+ *   up with.
+ * - Batch: every sample, delivered once batchSize samples are pending or
+ *   the oldest pending one is batchInterval ms old (0 disables either).
+ * - Latest: only the newest sample, at most rate times per second.
+ *
+ * At most maxPending samples wait for a consumer that falls behind; past
+ * that the oldest pending half is dropped and counted in droppedSamples().
+ *
+ * Configure before QkProtocol::subscribe(); deleting the subscription
+ * unsubscribes it.
+ */
+class QKLIBSHARED_EXPORT QkSubscription : public QObject
+{
+    Q_OBJECT
+public:
+    enum Mode
+    {
+        EverySample,
+        Batch,
+        Latest
+    };
+    enum
+    {
+        DefaultMaxPending = 16384 // samples
+    };
+
+    QkSubscription(int address, QObject *parent = 0);
+    ~QkSubscription();
+
+    void setMode(Mode mode) { m_mode = mode; }
+    void setBatchSize(int samples) { m_batchSize = samples; }
+    void setBatchInterval(int ms) { m_batchInterval = ms; }
+    void setRate(int hz) { m_rate = hz; }
+    void setMaxPending(int samples) { m_maxPending = samples; }
+
+    int address() const { return m_address; }
+    Mode mode() const { return m_mode; }
+    int batchSize() const { return m_batchSize; }
+    int batchInterval() const { return m_batchInterval; }
+    int rate() const { return m_rate; }
+    int maxPending() const { return m_maxPending; }
+    int droppedSamples() const { return m_droppedSamples.load(); }
+
+    void _setProtocol(QkProtocol *protocol) { m_protocol = protocol; }
+    void _push(const float *values, int channels, int samples, quint64 timestamp, int interval);
+
+signals:
+    void dataReceived(const QkDataBatch &batch);
+
+private slots:
+    void deliver();
+    void flush();
+
+private:
+    void post();
+    int pendingDelay();
+
+    QkProtocol *m_protocol;
+    int m_address;
+    Mode m_mode;
+    int m_batchSize;
+    int m_batchInterval;
+    int m_rate;
+    int m_maxPending;
+    QAtomicInt m_droppedSamples;
+
+    QkSpinLock m_lock;
+    QkDataBatch m_pending;
+    bool m_scheduled;
+    qint64 m_pendingSince;
+    qint64 m_lastDelivery;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+};
+
+#endif // QKSUBSCRIPTION_H
@@ -0,0 +1,129 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qktimerwheel.h"
+
+QkTimerWheel::QkTimerWheel(int tick)
+{
+    int i;
+
+    m_tick = (tick > 0 ? tick : 1);
+    m_currentTick = 0;
+    m_count = 0;
+
+    for(i = 0; i < Slots; i++)
+        m_buckets[i] = -1;
+    for(i = 0; i < Capacity; i++)
+        m_timers[i].active = false;
+}
+
+void QkTimerWheel::start(int id, qint64 deadline, qint64 now)
+{
+    if(m_timers[id].active)
+        unlink(id);
+
+    const qint64 nowTick = now / m_tick;
+    if(m_count == 0)
+        m_currentTick = nowTick;
+
+    qint64 tick = (deadline + m_tick - 1) / m_tick;
+    if(tick < m_currentTick)
+        tick = m_currentTick;
+
+    Timer &timer = m_timers[id];
+    const int bucket = (int)(tick % Slots);
+
+    timer.active = true;
+    timer.tick = tick;
+    timer.prev = -1;
+    timer.next = m_buckets[bucket];
+    if(timer.next >= 0)
+        m_timers[timer.next].prev = id;
+    m_buckets[bucket] = id;
+    m_count++;
+}
+
+void QkTimerWheel::stop(int id)
+{
+    if(m_timers[id].active)
+        unlink(id);
+}
+
+void QkTimerWheel::unlink(int id)
+{
+    Timer &timer = m_timers[id];
+
+    if(timer.prev >= 0)
+        m_timers[timer.prev].next = timer.next;
+    else
+        m_buckets[timer.tick % Slots] = timer.next;
+    if(timer.next >= 0)
+        m_timers[timer.next].prev = timer.prev;
+
+    timer.active = false;
+    m_count--;
+}
+
+int QkTimerWheel::expire(qint64 now, int *expired)
+{
+    // Visits the buckets of every tick elapsed since the last call (at most
+    // one full turn) and collects the timers that are due. Returns how many
+    // ids were written to 'expired', which must hold Capacity entries.
+    int count = 0;
+    const qint64 nowTick = now / m_tick;
+
+    if(m_count == 0)
+    {
+        m_currentTick = nowTick;
+        return 0;
+    }
+
+    qint64 lastTick = m_currentTick + Slots - 1;
+    if(nowTick < lastTick)
+        lastTick = nowTick;
+
+    for(qint64 tick = m_currentTick; tick <= lastTick; tick++)
+    {
+        int id = m_buckets[tick % Slots];
+        while(id >= 0)
+        {
+            const int next = m_timers[id].next;
+            if(m_timers[id].tick <= nowTick)
+            {
+                unlink(id);
+                expired[count++] = id;
+            }
+            id = next;
+        }
+    }
+
+    if(nowTick >= m_currentTick)
+        m_currentTick = nowTick + 1;
+
+    return count;
+}
+
+int QkTimerWheel::timeToNextTick(qint64 now)
+{
+    if(m_count == 0)
+        return -1;
+
+    const qint64 next = m_currentTick * m_tick;
+    return (next > now ? (int)(next - now) : 0);
+}
@@ -0,0 +1,68 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QKTIMERWHEEL_H
+#define QKTIMERWHEEL_H
+
+#include <QtGlobal>
+
+/**
+ * Hashed timer wheel for a fixed set of timer ids (0..Capacity-1).
+ * Timers hash into a bucket by their deadline tick and are kept in
+ * intrusive lists, so start, stop and expiry are O(1) per timer.
+ */
+class QkTimerWheel
+{
+public:
+    enum
+    {
+        Capacity = 256,
+        Slots = 64
+    };
+
+    QkTimerWheel(int tick = 10);
+
+    void start(int id, qint64 deadline, qint64 now);
+    void stop(int id);
+    bool isActive(int id) { return m_timers[id].active; }
+    int count() { return m_count; }
+
+    int expire(qint64 now, int *expired);
+    int timeToNextTick(qint64 now);
+
+private:
+    class Timer
+    {
+    public:
+        bool active;
+        qint64 tick;
+        int prev;
+        int next;
+    };
+
+    void unlink(int id);
+
+    Timer m_timers[Capacity];
+    int m_buckets[Slots];
+    qint64 m_currentTick;
+    int m_tick;
+    int m_count;
+};
+
+#endif // QKTIMERWHEEL_H
@@ -0,0 +1,6 @@
+include(../../tests.pri)
+
+TARGET = tst_aggregator
+
+SOURCES += \
+    tst_aggregator.cpp
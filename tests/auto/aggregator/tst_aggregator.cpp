@@ -0,0 +1,177 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "qkaggregator.h"
+
+class tst_Aggregator : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void window_data();
+    void window();
+    void rollups();
+    void timeGoesBack();
+    void mergeEmpty();
+
+private:
+    static float value(int channel, int i);
+};
+
+float tst_Aggregator::value(int channel, int i)
+{
+    return (channel == 0 ? (float) (i % 37 - 18) : 0.5f * i);
+}
+
+void tst_Aggregator::window_data()
+{
+    QTest::addColumn<int>("period");
+    QTest::addColumn<int>("samples");
+    QTest::addColumn<int>("ms");
+    QTest::addColumn<int>("level");
+
+    QTest::newRow("1 s from 100 ms buckets") << 10 << 300 << 1000 << (int) QkAggregator::Level100ms;
+    QTest::newRow("1 min from 1 s buckets") << 100 << 1800 << 60000 << (int) QkAggregator::Level1s;
+    QTest::newRow("longer than the history") << 10 << 300 << 10000 << (int) QkAggregator::Level100ms;
+}
+
+// The window merges the still open bucket with closed ones back to the
+// one holding now - ms, so it must match the raw samples from the start
+// of that bucket on.
+void tst_Aggregator::window()
+{
+    QFETCH(int, period);
+    QFETCH(int, samples);
+    QFETCH(int, ms);
+    QFETCH(int, level);
+
+    QkAggregator aggregator;
+    for(int i = 0; i < samples; i++)
+    {
+        const float values[2] = { value(0, i), value(1, i) };
+        aggregator.add(values, 2, (quint64) i * period);
+    }
+
+    const quint64 last = (quint64) (samples - 1) * period;
+    const quint64 from = (last > (quint64) ms ? last - ms : 0);
+    const quint64 start = from - from % QkAggregator::resolution(level);
+
+    for(int c = 0; c < 2; c++)
+    {
+        QkAggregator::Rollup expected;
+        expected.reset(start);
+        for(int i = 0; i < samples; i++)
+            if((quint64) i * period >= start)
+                expected.add(value(c, i));
+
+        const QkAggregator::Rollup result = aggregator.window(c, ms);
+        QCOMPARE(result.count, expected.count);
+        QCOMPARE(result.timestamp, expected.timestamp);
+        QCOMPARE(result.min, expected.min);
+        QCOMPARE(result.max, expected.max);
+        QVERIFY(qAbs(result.mean() - expected.mean()) < 1e-3);
+        QVERIFY(qAbs(result.rms() - expected.rms()) < 1e-3);
+    }
+    QCOMPARE(aggregator.window(2, ms).count, 0);
+}
+
+void tst_Aggregator::rollups()
+{
+    // 2.5 s of samples: two closed 1 s buckets and the open one
+    QkAggregator aggregator;
+    for(int i = 0; i < 250; i++)
+    {
+        const float values[1] = { value(1, i) };
+        aggregator.add(values, 1, (quint64) i * 10);
+    }
+
+    QVector<QkAggregator::Rollup> buckets;
+    QCOMPARE(aggregator.rollups(0, QkAggregator::Level1s, 0, 10000, &buckets), 3);
+    QCOMPARE(buckets.at(0).timestamp, (quint64) 0);
+    QCOMPARE(buckets.at(1).timestamp, (quint64) 1000);
+    QCOMPARE(buckets.at(2).timestamp, (quint64) 2000);
+    QCOMPARE(buckets.at(0).count, 100);
+    QCOMPARE(buckets.at(2).count, 50);
+    QCOMPARE(buckets.at(1).min, value(1, 100));
+    QCOMPARE(buckets.at(1).max, value(1, 199));
+
+    QkAggregator::Rollup merged;
+    foreach(const QkAggregator::Rollup &bucket, buckets)
+        merged.merge(bucket);
+    QCOMPARE(merged.count, 250);
+    QCOMPARE(merged.min, value(1, 0));
+    QCOMPARE(merged.max, value(1, 249));
+
+    buckets.clear();
+    QCOMPARE(aggregator.rollups(0, QkAggregator::Level1s, 1000, 1000, &buckets), 1);
+    QCOMPARE(buckets.at(0).timestamp, (quint64) 1000);
+}
+
+void tst_Aggregator::timeGoesBack()
+{
+    // 1.5 s of samples, then a resync moves time back by 800 ms
+    QkAggregator aggregator;
+    for(int i = 0; i < 150; i++)
+    {
+        const float values[1] = { value(1, i) };
+        aggregator.add(values, 1, (quint64) i * 10);
+    }
+    for(int i = 0; i < 20; i++)
+    {
+        const float values[1] = { value(1, 150 + i) };
+        aggregator.add(values, 1, 700 + (quint64) i * 10);
+    }
+
+    QVector<QkAggregator::Rollup> buckets;
+    QCOMPARE(aggregator.rollups(0, QkAggregator::Level1s, 0, 10000, &buckets), 2);
+    QCOMPARE(buckets.at(0).timestamp, (quint64) 0);
+    QCOMPARE(buckets.at(0).count, 100);
+    QCOMPARE(buckets.at(1).timestamp, (quint64) 1000);
+    QCOMPARE(buckets.at(1).count, 70);
+    QCOMPARE(buckets.at(1).max, value(1, 169));
+
+    // the window still ends at the latest timestamp seen: the 100 ms
+    // buckets from 900 to 1400, the last one holding the late samples
+    QCOMPARE(aggregator.window(0, 500).count, 80);
+}
+
+void tst_Aggregator::mergeEmpty()
+{
+    QkAggregator::Rollup a;
+    QkAggregator::Rollup b;
+    b.reset(500);
+    b.add(-3.0f);
+    b.add(4.0f);
+
+    a.merge(QkAggregator::Rollup());
+    QCOMPARE(a.count, 0);
+    a.merge(b);
+    QCOMPARE(a.count, 2);
+    QCOMPARE(a.timestamp, (quint64) 500);
+    QCOMPARE(a.min, -3.0f);
+    QCOMPARE(a.max, 4.0f);
+    QCOMPARE(a.mean(), 0.5f);
+    QCOMPARE(a.rms(), 3.5355339f);
+}
+
+QTEST_APPLESS_MAIN(tst_Aggregator)
+
+#include "tst_aggregator.moc"
@@ -0,0 +1,6 @@
+include(../../tests.pri)
+
+TARGET = tst_checksum
+
+SOURCES += \
+    tst_checksum.cpp
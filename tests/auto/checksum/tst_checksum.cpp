@@ -0,0 +1,118 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "qkprotocol.h"
+
+class tst_Checksum : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void byteXor();
+    void corruptedFrameDropped();
+    void offByDefault();
+
+private:
+    static QkFrame frame(const QByteArray &payload);
+    static int feed(QkProtocolWorker *worker, const QkFrame &frame);
+};
+
+// ctrl (notification), code, payload and the checksum byte
+QkFrame tst_Checksum::frame(const QByteArray &payload)
+{
+    QkFrame frame;
+    frame.data.append((char) QK_PACKET_FLAGMASK_CTRL_NOTIF);
+    frame.data.append((char) 0);
+    frame.data.append((char) QK_PACKET_CODE_STRING);
+    frame.data.append(payload);
+    frame.data.append((char) QkPacket::checksum(frame.data.constData(), frame.data.count()));
+    frame.timestamp = 0;
+    return frame;
+}
+
+// Hands the frame to an idle worker and returns how many packets it let
+// through to the protocol.
+int tst_Checksum::feed(QkProtocolWorker *worker, const QkFrame &frame)
+{
+    int packets = 0;
+    QMetaObject::Connection connection =
+            QObject::connect(worker, &QkProtocolWorker::packetReady, [&packets](const QkPacket &) {
+        packets++;
+    });
+    worker->receiveFrame(frame);
+    worker->service();
+    QObject::disconnect(connection);
+    return packets;
+}
+
+void tst_Checksum::byteXor()
+{
+    // The word-folded implementation must equal the plain byte XOR the
+    // header documents, at every length and alignment.
+    QByteArray data;
+    for(int i = 0; i < 80; i++)
+        data.append((char) (i * 37 + 11));
+
+    for(int offset = 0; offset < 8; offset++)
+    {
+        for(int count = 0; count + offset <= data.count(); count++)
+        {
+            quint8 expected = 0;
+            for(int i = 0; i < count; i++)
+                expected ^= (quint8) data.at(offset + i);
+            QCOMPARE(QkPacket::checksum(data.constData() + offset, count), expected);
+        }
+    }
+}
+
+void tst_Checksum::corruptedFrameDropped()
+{
+    QkProtocolWorker worker;
+    worker.setVerifyChecksum(true);
+
+    const QkFrame good = frame("hello, checksum");
+    QCOMPARE(feed(&worker, good), 1);
+    QCOMPARE(worker.checksumErrors(), 0);
+
+    for(int i = 0; i < good.data.count(); i++)
+    {
+        QkFrame bad = good;
+        bad.data[i] = bad.data.at(i) ^ 0x10;
+        QCOMPARE(feed(&worker, bad), 0);
+        QCOMPARE(worker.checksumErrors(), i + 1);
+    }
+    QCOMPARE(worker.malformedFrames(), 0);
+}
+
+void tst_Checksum::offByDefault()
+{
+    QkProtocolWorker worker;
+    QVERIFY(!worker.verifyChecksum());
+
+    QkFrame bad = frame("hello, checksum");
+    bad.data[4] = bad.data.at(4) ^ 0x01;
+    QCOMPARE(feed(&worker, bad), 1);
+    QCOMPARE(worker.checksumErrors(), 0);
+}
+
+QTEST_APPLESS_MAIN(tst_Checksum)
+
+#include "tst_checksum.moc"
@@ -0,0 +1,6 @@
+include(../../tests.pri)
+
+TARGET = tst_codec
+
+SOURCES += \
+    tst_codec.cpp
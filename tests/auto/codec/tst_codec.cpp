@@ -0,0 +1,119 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include <limits.h>
+#include <string.h>
+
+#include "qkcodec.h"
+
+// decodeSamples() converts 8 and 4 lanes at a time on SSE2 targets and
+// finishes with a scalar tail; the counts below land on every mix of the
+// two, and on the scalar loop alone elsewhere.
+class tst_Codec : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void decodeSamples_data();
+    void decodeSamples();
+    void decodeInts();
+
+private:
+    static QByteArray encode(const QVector<qint32> &lanes, int offset);
+};
+
+// little-endian lanes starting offset bytes into the array, so the loads
+// are unaligned as they are inside a packet
+QByteArray tst_Codec::encode(const QVector<qint32> &lanes, int offset)
+{
+    QByteArray bytes(offset, 0x7E);
+    foreach(qint32 lane, lanes)
+    {
+        const quint32 u = (quint32) lane;
+        bytes.append((char) (u & 0xFF));
+        bytes.append((char) ((u >> 8) & 0xFF));
+        bytes.append((char) ((u >> 16) & 0xFF));
+        bytes.append((char) ((u >> 24) & 0xFF));
+    }
+    return bytes;
+}
+
+void tst_Codec::decodeSamples_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<int>("offset");
+
+    const int counts[] = {0, 1, 3, 4, 5, 7, 8, 9, 12, 15, 16, 17, 37};
+    for(unsigned i = 0; i < sizeof(counts)/sizeof(counts[0]); i++)
+        for(int offset = 0; offset < 4; offset += 3)
+            QTest::newRow(qPrintable(QString("%1 lanes +%2").arg(counts[i]).arg(offset)))
+                    << counts[i] << offset;
+}
+
+void tst_Codec::decodeSamples()
+{
+    QFETCH(int, count);
+    QFETCH(int, offset);
+
+    qsrand(count);
+    QVector<qint32> lanes;
+    for(int i = 0; i < count; i++)
+    {
+        switch(i % 5)
+        {
+        case 0: lanes.append(INT_MIN + i); break;
+        case 1: lanes.append(INT_MAX - i); break;
+        default: lanes.append((qint32) ((quint32) qrand() * 2654435761u));
+        }
+    }
+    const QByteArray bytes = encode(lanes, offset);
+    const char *src = bytes.constData() + offset;
+
+    // one guard lane past the end must stay untouched
+    QVector<float> dst(count + 1, -1.0f);
+    QkCodec::decodeSamples(src, count, true, dst.data());
+    for(int i = 0; i < count; i++)
+        QCOMPARE(dst.at(i), (float) lanes.at(i));
+    QCOMPARE(dst.at(count), -1.0f);
+
+    // float lanes keep their exact bit patterns
+    QVector<float> expected(count);
+    memcpy(expected.data(), lanes.constData(), count * sizeof(float));
+    dst.fill(-1.0f);
+    QkCodec::decodeSamples(src, count, false, dst.data());
+    QVERIFY(memcmp(dst.constData(), expected.constData(), count * sizeof(float)) == 0);
+    QCOMPARE(dst.at(count), -1.0f);
+}
+
+void tst_Codec::decodeInts()
+{
+    QVector<qint32> lanes;
+    lanes << 0 << -1 << INT_MIN << INT_MAX << 16777217 << -16777217 << 42;
+    const QByteArray bytes = encode(lanes, 1);
+
+    QVector<qint32> dst(lanes.count());
+    QkCodec::decodeInts(bytes.constData() + 1, lanes.count(), dst.data());
+    QCOMPARE(dst, lanes);
+}
+
+QTEST_APPLESS_MAIN(tst_Codec)
+
+#include "tst_codec.moc"
@@ -0,0 +1,6 @@
+include(../../tests.pri)
+
+TARGET = tst_deframer
+
+SOURCES += \
+    tst_deframer.cpp
@@ -0,0 +1,201 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "qkconnect.h"
+
+// The byte-by-byte state machine that parseData() replaced
+// (QkConnSerialWorker::parseSerialData), kept as the reference.
+class ReferenceDeframer
+{
+public:
+    ReferenceDeframer()
+    {
+        receiving = false;
+        valid = false;
+        escape = false;
+    }
+
+    void parse(const QByteArray &data)
+    {
+        for(int i = 0; i < data.count(); i++)
+            parse((quint8) data.at(i));
+    }
+
+    void parse(quint8 data)
+    {
+        switch(data)
+        {
+        case QK_COMM_FLAG:
+            if(!escape)
+            {
+                if(!receiving)
+                {
+                    frame.clear();
+                    receiving = true;
+                    valid = true;
+                }
+                else if(valid && frame.count() > 0)
+                {
+                    frames.append(frame);
+                    receiving = false;
+                    valid = false;
+                }
+                return;
+            }
+            break;
+        case QK_COMM_DLE:
+            if(valid && !escape)
+            {
+                escape = true;
+                return;
+            }
+            break;
+        default: ;
+        }
+
+        if(valid)
+            frame.append((char) data);
+        escape = false;
+    }
+
+    QList<QByteArray> frames;
+
+private:
+    QByteArray frame;
+    bool receiving;
+    bool valid;
+    bool escape;
+};
+
+class Worker : public QkConnWorker
+{
+public:
+    Worker() : QkConnWorker(0)
+    {
+        connect(this, &QkConnWorker::frameReady, [this](const QkFrame &frame) {
+            frames.append(frame.data);
+        });
+    }
+
+    void run() {}
+    void feed(const QByteArray &data) { parseData(data.constData(), data.count()); }
+
+    QList<QByteArray> frames;
+
+protected:
+    bool openDevice() { return true; }
+    void closeDevice() {}
+    QIODevice* device() { return 0; }
+};
+
+class tst_Deframer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void sameFrames_data();
+    void sameFrames();
+    void randomStreams();
+    void oversizedFrame();
+
+private:
+    static QByteArray bytes(const char *hex) { return QByteArray::fromHex(hex); }
+};
+
+void tst_Deframer::sameFrames_data()
+{
+    QTest::addColumn<QByteArray>("stream");
+
+    QTest::newRow("plain") << bytes("5501020355");
+    QTest::newRow("escaped") << bytes("5501DD55DDDD0255");
+    QTest::newRow("noise before") << bytes("0011DD2255010255");
+    QTest::newRow("empty frames") << bytes("5555550155");
+    QTest::newRow("back to back") << bytes("5501555502035555");
+    QTest::newRow("unterminated") << bytes("550102DD");
+    QTest::newRow("escape at end") << bytes("5501DD55");
+}
+
+void tst_Deframer::sameFrames()
+{
+    QFETCH(QByteArray, stream);
+
+    ReferenceDeframer reference;
+    reference.parse(stream);
+
+    Worker whole;
+    whole.feed(stream);
+    QCOMPARE(whole.frames, reference.frames);
+
+    Worker byByte;
+    for(int i = 0; i < stream.count(); i++)
+        byByte.feed(stream.mid(i, 1));
+    QCOMPARE(byByte.frames, reference.frames);
+}
+
+void tst_Deframer::randomStreams()
+{
+    qsrand(1);
+    for(int run = 0; run < 200; run++)
+    {
+        // control bytes are made common so every state gets exercised
+        QByteArray stream;
+        const int size = qrand() % 600;
+        for(int i = 0; i < size; i++)
+        {
+            switch(qrand() % 8)
+            {
+            case 0: stream.append((char) QK_COMM_FLAG); break;
+            case 1: stream.append((char) QK_COMM_DLE); break;
+            default: stream.append((char) (qrand() & 0xFF));
+            }
+        }
+
+        ReferenceDeframer reference;
+        reference.parse(stream);
+
+        Worker worker;
+        for(int i = 0; i < stream.count(); )
+        {
+            const int chunk = 1 + qrand() % 64;
+            worker.feed(stream.mid(i, chunk));
+            i += chunk;
+        }
+        QCOMPARE(worker.frames, reference.frames);
+    }
+}
+
+void tst_Deframer::oversizedFrame()
+{
+    QByteArray stream;
+    stream.append((char) QK_COMM_FLAG);
+    stream.append(QByteArray(2*QK_FRAME_MAX_SIZE, 0x01));
+    stream.append(bytes("55010255"));
+
+    Worker worker;
+    worker.feed(stream);
+    QCOMPARE(worker.frames.count(), 1);
+    QCOMPARE(worker.frames.first(), bytes("0102"));
+    QCOMPARE(worker.oversizedFrames(), 1);
+}
+
+QTEST_APPLESS_MAIN(tst_Deframer)
+
+#include "tst_deframer.moc"
@@ -0,0 +1,6 @@
+include(../../tests.pri)
+
+TARGET = tst_ring
+
+SOURCES += \
+    tst_ring.cpp
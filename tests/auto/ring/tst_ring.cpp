@@ -0,0 +1,149 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+#include <QThread>
+
+#include "qkring.h"
+
+class tst_Ring : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void capacity();
+    void full();
+    void wrapAround();
+    void inPlace();
+    void twoThreads();
+};
+
+void tst_Ring::capacity()
+{
+    QkRing<int> ring(5);
+    QCOMPARE(ring.capacity(), 8);
+    ring.setCapacity(64);
+    QCOMPARE(ring.capacity(), 64);
+    QVERIFY(ring.isEmpty());
+}
+
+void tst_Ring::full()
+{
+    QkRing<int> ring(4);
+    for(int i = 0; i < 4; i++)
+        QVERIFY(ring.put(i));
+    QVERIFY(!ring.put(4));
+    QVERIFY(ring.next() == 0);
+    QCOMPARE(ring.overflows(), 2);
+    QCOMPARE(ring.count(), 4);
+    QCOMPARE(ring.highWater(), 4);
+
+    ring.pop();
+    QVERIFY(ring.put(4));
+    QCOMPARE(*ring.front(), 1);
+}
+
+void tst_Ring::wrapAround()
+{
+    // Goes round the slots many times at every fill level.
+    QkRing<int> ring(8);
+    int in = 0;
+    int out = 0;
+
+    for(int fill = 1; fill <= 8; fill++)
+    {
+        for(int turn = 0; turn < 10 * 8; turn++)
+        {
+            while(ring.count() < fill)
+                QVERIFY(ring.put(in++));
+            QCOMPARE(*ring.front(), out++);
+            ring.pop();
+        }
+    }
+    while(!ring.isEmpty())
+    {
+        QCOMPARE(*ring.front(), out++);
+        ring.pop();
+    }
+    QCOMPARE(out, in);
+    QVERIFY(ring.front() == 0);
+    QCOMPARE(ring.overflows(), 0);
+    QCOMPARE(ring.highWater(), 8);
+}
+
+void tst_Ring::inPlace()
+{
+    // next()/push() hand out the same preallocated slots on every turn
+    QkRing<QByteArray> ring(2);
+
+    for(int i = 0; i < 6; i++)
+    {
+        QByteArray *slot = ring.next();
+        QVERIFY(slot == &ring.slot(i));
+        *slot = QByteArray::number(i);
+        ring.push();
+
+        QVERIFY(ring.front() == &ring.slot(i));
+        QCOMPARE(*ring.front(), QByteArray::number(i));
+        ring.pop();
+    }
+}
+
+class Producer : public QThread
+{
+public:
+    Producer(QkRing<int> *ring, int count) : m_ring(ring), m_count(count) {}
+
+    void run()
+    {
+        for(int i = 0; i < m_count; i++)
+            while(!m_ring->put(i))
+                QThread::yieldCurrentThread();
+    }
+
+private:
+    QkRing<int> *m_ring;
+    int m_count;
+};
+
+void tst_Ring::twoThreads()
+{
+    const int count = 200000;
+    QkRing<int> ring(16);
+    Producer producer(&ring, count);
+
+    producer.start();
+    for(int expected = 0; expected < count; )
+    {
+        int *item = ring.front();
+        if(item == 0)
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        QCOMPARE(*item, expected++);
+        ring.pop();
+    }
+    QVERIFY(producer.wait(10000));
+    QVERIFY(ring.isEmpty());
+}
+
+QTEST_APPLESS_MAIN(tst_Ring)
+
+#include "tst_ring.moc"
@@ -0,0 +1,127 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "qktimerwheel.h"
+
+class tst_TimerWheel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void neverEarly();
+    void stop();
+    void laterTurns();
+    void longSleep();
+    void timeToNextTick();
+
+private:
+    static QList<int> expire(QkTimerWheel *wheel, qint64 now);
+};
+
+QList<int> tst_TimerWheel::expire(QkTimerWheel *wheel, qint64 now)
+{
+    int ids[QkTimerWheel::Capacity];
+    QList<int> list;
+
+    const int count = wheel->expire(now, ids);
+    for(int i = 0; i < count; i++)
+        list.append(ids[i]);
+    qSort(list);
+    return list;
+}
+
+void tst_TimerWheel::neverEarly()
+{
+    QkTimerWheel wheel(10);
+
+    wheel.start(1, 5, 0);
+    wheel.start(2, 25, 0);
+    QVERIFY(expire(&wheel, 4).isEmpty());
+    QVERIFY(expire(&wheel, 9).isEmpty());
+    QCOMPARE(expire(&wheel, 10), QList<int>() << 1);
+    QVERIFY(expire(&wheel, 29).isEmpty());
+    QCOMPARE(expire(&wheel, 30), QList<int>() << 2);
+    QCOMPARE(wheel.count(), 0);
+}
+
+void tst_TimerWheel::stop()
+{
+    QkTimerWheel wheel(10);
+
+    wheel.start(1, 100, 0);
+    wheel.start(2, 100, 0);
+    wheel.start(3, 100, 0);
+    wheel.stop(2);
+    QVERIFY(!wheel.isActive(2));
+    QCOMPARE(wheel.count(), 2);
+    QCOMPARE(expire(&wheel, 100), QList<int>() << 1 << 3);
+
+    // restarting an active timer moves it
+    wheel.start(4, 100, 100);
+    wheel.start(4, 300, 100);
+    QVERIFY(expire(&wheel, 200).isEmpty());
+    QCOMPARE(expire(&wheel, 300), QList<int>() << 4);
+}
+
+void tst_TimerWheel::laterTurns()
+{
+    // Both deadlines hash to the same slot, one turn of the wheel apart.
+    QkTimerWheel wheel(10);
+    const qint64 turn = 10 * QkTimerWheel::Slots;
+
+    wheel.start(1, 100, 0);
+    wheel.start(2, 100 + turn, 0);
+    QCOMPARE(expire(&wheel, 100), QList<int>() << 1);
+    QVERIFY(wheel.isActive(2));
+    QVERIFY(expire(&wheel, 99 + turn).isEmpty());
+    QCOMPARE(expire(&wheel, 100 + turn), QList<int>() << 2);
+}
+
+void tst_TimerWheel::longSleep()
+{
+    // A caller late by several turns still gets every due timer at once.
+    QkTimerWheel wheel(10);
+    const qint64 turn = 10 * QkTimerWheel::Slots;
+    QList<int> all;
+
+    for(int id = 0; id < QkTimerWheel::Capacity; id++)
+    {
+        wheel.start(id, id * 7, 0);
+        all.append(id);
+    }
+    QCOMPARE(expire(&wheel, 5 * turn), all);
+    QCOMPARE(wheel.count(), 0);
+}
+
+void tst_TimerWheel::timeToNextTick()
+{
+    QkTimerWheel wheel(10);
+
+    QCOMPARE(wheel.timeToNextTick(0), -1);
+    wheel.start(1, 50, 3);
+    QCOMPARE(wheel.timeToNextTick(3), 0);
+    expire(&wheel, 3);
+    QCOMPARE(wheel.timeToNextTick(3), 7);
+}
+
+QTEST_APPLESS_MAIN(tst_TimerWheel)
+
+#include "tst_timerwheel.moc"
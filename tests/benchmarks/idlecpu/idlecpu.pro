@@ -0,0 +1,8 @@
+include(../../tests.pri)
+
+TARGET = tst_idlecpu
+
+unix: LIBS += -lutil
+
+SOURCES += \
+    tst_idlecpu.cpp
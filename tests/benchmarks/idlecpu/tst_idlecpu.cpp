@@ -0,0 +1,178 @@
+/*
+ * QkThings LICENSE
+ * The open source framework and modular platform for smart devices.
+ * Copyright (C) 2014 <http://qkthings.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+#include <QElapsedTimer>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include "qkconnect.h"
+
+#ifdef Q_OS_LINUX
+#include <pty.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+// Opens connected but quiet links, serial ones on pseudo-terminals and TCP
+// ones to loopback servers, and measures the CPU the whole process burns
+// while nothing is sent or received. With the workers blocking instead of
+// spinning this should be close to zero, whatever the number of links.
+class tst_IdleCpu : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum
+    {
+        MeasureTime = 3000, // ms
+        MaxCpuPercent = 2
+    };
+
+private slots:
+    void idle_data();
+    void idle();
+
+private:
+    static qint64 cpuTime();
+};
+
+// user + system time of the process, in ms
+qint64 tst_IdleCpu::cpuTime()
+{
+#ifdef Q_OS_LINUX
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (qint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+#else
+    return 0;
+#endif
+}
+
+void tst_IdleCpu::idle_data()
+{
+    QTest::addColumn<int>("type");
+    QTest::addColumn<int>("links");
+    QTest::addColumn<int>("reactorThreads");
+
+    const int serial = QkConnection::tSerial;
+    const int tcp = QkConnection::tTCP;
+    QTest::newRow("serial, 1 link, own threads") << serial << 1 << 0;
+    QTest::newRow("serial, 12 links, own threads") << serial << 12 << 0;
+    QTest::newRow("serial, 12 links, 1 reactor") << serial << 12 << 1;
+    QTest::newRow("tcp, 1 link, own threads") << tcp << 1 << 0;
+    QTest::newRow("tcp, 12 links, own threads") << tcp << 12 << 0;
+    QTest::newRow("tcp, 12 links, 1 reactor") << tcp << 12 << 1;
+}
+
+void tst_IdleCpu::idle()
+{
+#ifdef Q_OS_LINUX
+    QFETCH(int, type);
+    QFETCH(int, links);
+    QFETCH(int, reactorThreads);
+
+    QList<int> masters;
+    QList<QTcpServer*> servers;
+    QkConnectionManager manager;
+    manager.setReactorThreads(reactorThreads);
+
+    for(int i = 0; i < links; i++)
+    {
+        QkConnection::Descriptor desc;
+        desc.type = (QkConnection::Type) type;
+        if(type == QkConnection::tSerial)
+        {
+            int master, slave;
+            char name[64];
+            if(openpty(&master, &slave, name, 0, 0) < 0)
+                QSKIP("No pseudo-terminals available");
+            ::close(slave); // the master end stays open and silent
+            masters.append(master);
+
+            desc.parameters["portName"] = QString(name);
+            desc.parameters["baudRate"] = 38400;
+        }
+        else
+        {
+            // one server per link: the manager refuses two links to the
+            // same host and port
+            QTcpServer *server = new QTcpServer(this);
+            servers.append(server);
+            if(!server->listen(QHostAddress::LocalHost, 0))
+            {
+                qDeleteAll(servers);
+                QSKIP("Failed to listen on the loopback interface");
+            }
+
+            desc.parameters["host"] = QString("127.0.0.1");
+            desc.parameters["port"] = server->serverPort();
+        }
+        QVERIFY(manager.addConnection(desc) != 0);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    foreach(QkConnection *conn, manager.connections())
+    {
+        while(!conn->isConnected() && timer.elapsed() < 5000)
+            QTest::qWait(20);
+        if(!conn->isConnected())
+        {
+            foreach(int master, masters)
+                ::close(master);
+            qDeleteAll(servers);
+            QSKIP("Failed to open the links");
+        }
+    }
+    // accept the TCP links; the server ends stay open and silent
+    foreach(QTcpServer *server, servers)
+    {
+        server->waitForNewConnection(1000);
+        while(server->hasPendingConnections())
+            server->nextPendingConnection(); // owned by the server
+    }
+
+    QTest::qSleep(100); // let the connect handshakes settle
+    const qint64 cpuStart = cpuTime();
+    timer.restart();
+    QTest::qSleep(MeasureTime);
+    const qint64 cpu = cpuTime() - cpuStart;
+    const qint64 wall = timer.elapsed();
+
+    const double percent = 100.0 * cpu / wall;
+    qDebug("%d idle link(s): %lld ms CPU in %lld ms (%.2f%%)",
+           links, cpu, wall, percent);
+
+    foreach(QkConnection *conn, manager.connections())
+        conn->close();
+    foreach(int master, masters)
+        ::close(master);
+    qDeleteAll(servers);
+
+    QVERIFY2(percent < MaxCpuPercent, "idle links are burning CPU");
+#else
+    QSKIP("Needs Linux pseudo-terminals");
+#endif
+}
+
+QTEST_GUILESS_MAIN(tst_IdleCpu)
+
+#include "tst_idlecpu.moc"
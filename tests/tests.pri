@@ -0,0 +1,19 @@
+# Shared settings of the unit tests and benchmarks. They link against the
+# library built in place by ../qkcore.pro.
+
+QT       -= gui
+QT       += testlib
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += serialport
+QT       += network
+
+CONFIG += c++11 testcase console
+CONFIG -= app_bundle
+
+INCLUDEPATH += $$PWD/.. $$PWD/../../utils
+
+CONFIG(debug, debug|release) {
+    LIBS += -L$$PWD/../debug -lqkcore
+} else {
+    LIBS += -L$$PWD/../release -lqkcore
+}
@@ -0,0 +1,10 @@
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    auto/deframer \
+    auto/timerwheel \
+    auto/codec \
+    auto/aggregator \
+    auto/ring \
+    auto/checksum \
+    benchmarks/idlecpu